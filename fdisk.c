@@ -32,6 +32,8 @@
 #include "fdisk_memory.h"
 #include "fdisk_screen.h"
 #include "fdisk_fat32.h"
+#include "fdisk_cache.h"
+#include "fdisk_geometry.h"
 #ifdef __CC65__
 #include "ascii.h"
 #endif
@@ -52,6 +54,8 @@ uint8_t hardware_model_id = 0xff;
 unsigned long slot_size = 8UL * 0x100000UL;
 
 int format_disk(void);
+unsigned char existing_file_system_unclean(void);
+void repair_existing_file_system(void);
 void open_sdcard_and_retrieve_details(void);
 
 #ifdef __CC65__
@@ -71,6 +75,7 @@ mega65slotT mega65slot[MAX_SLOT];
 unsigned char dont_confirm = 0;
 
 uint8_t sector_buffer[512];
+uint8_t multi_sector_buffer[MULTI_SECTOR_COUNT * 512];
 
 void clear_sector_buffer(void)
 {
@@ -155,8 +160,8 @@ uint8_t boot_bytes[258] = {
   // BIOS Parameter block.  We patch certain
   // values in here.
   0x00, 0x02,                   // Sector size = 512 bytes
-  0x08,                         // Sectors per cluster
-  /* 0x0e */ 0x38, 0x02,        // Number of reserved sectors (0x238 = 568)
+  0x08,                         // Sectors per cluster (patched)
+  /* 0x0e */ 0x38, 0x02,        // Number of reserved sectors (patched)
   /* 0x10 */ 0x02,              // Number of FATs
   0x00, 0x00,                   // Max directory entries for FAT12/16 (0 for FAT32)
   /* offset 0x13 */ 0x00, 0x00, // Total logical sectors (0 for FAT32)
@@ -202,7 +207,8 @@ uint8_t boot_bytes[258] = {
 
 };
 
-void build_dosbootsector(uint32_t data_sectors, uint32_t fs_sectors_per_fat)
+void build_dosbootsector(
+    uint32_t data_sectors, uint32_t fs_sectors_per_fat, uint8_t fs_sectors_per_cluster, uint16_t fs_reserved_sectors)
 {
   uint16_t i;
 
@@ -211,6 +217,13 @@ void build_dosbootsector(uint32_t data_sectors, uint32_t fs_sectors_per_fat)
   // Start with template, and then modify relevant fields */
   xcopy(boot_bytes, sector_buffer, sizeof(boot_bytes));
 
+  // 0x0d = sectors per cluster
+  sector_buffer[0x0d] = fs_sectors_per_cluster;
+
+  // 0x0e-0x0f = reserved sectors before the first FAT
+  sector_buffer[0x0e] = fs_reserved_sectors & 0xff;
+  sector_buffer[0x0f] = fs_reserved_sectors >> 8;
+
   // 0x20-0x23 = 32-bit number of data sectors in file system
   for (i = 0; i < 4; i++)
     sector_buffer[0x20 + i] = ((data_sectors) >> (i * 8)) & 0xff;
@@ -300,17 +313,30 @@ uint16_t service_dir_sectors;
 
 // Calculate clusters for file system, and FAT size
 uint32_t fs_clusters = 0;
-uint32_t reserved_sectors = 568; // not sure why we use this value
+uint32_t reserved_sectors = 568; // set by open_sdcard_and_retrieve_details() to align the FATs
 uint32_t rootdir_sector = 0;
 uint32_t fat_sectors = 0;
 uint32_t fat1_sector = 0;
 uint32_t fat2_sector = 0;
 uint32_t fs_data_sectors = 0;
-uint8_t sectors_per_cluster = 8; // 4KB clusters
+uint8_t sectors_per_cluster = 8; // 4KB clusters, until a card is opened
+/*
+  SD cards are erased and written in allocation units (typically 4MB), and
+  writes that don't straddle them are much faster. So the FAT partition,
+  the first FAT and the first cluster all start on an allocation unit
+  boundary. Smaller cards get smaller units, so that not too much space is
+  lost to the padding.
+*/
+#ifndef FAT_ALIGN_SECTORS
+#define FAT_ALIGN_SECTORS 8192UL // 4MB
+#endif
+uint32_t fat_align_sectors = FAT_ALIGN_SECTORS;
+
+// Sectors per cluster to format with (1-128, a power of 2), or 0 to choose from the size of the partition
+uint8_t requested_sectors_per_cluster = 0;
 uint8_t volume_name[11] = {'M', 'E', 'G', 'A', '6', '5', 'F', 'D', 'I', 'S', 'K'};
 
-// Work out maximum number of clusters we can accommodate
-uint32_t sectors_required;
+// Sectors after the reserved ones, for the FATs and data
 uint32_t fat_available_sectors;
 
 void sector_buffer_write_uint16(const uint16_t offset, const uint32_t value)
@@ -365,13 +391,9 @@ void build_mega65_sys_sector(const uint32_t sys_partition_sectors)
   // Take 1MB from partition size, for reserved space when
   // calculating what can fit.
   uint32_t reserved_sectors = 1024UL * 1024UL / 512UL;
-  uint32_t slot_count = (sys_partition_sectors - reserved_sectors) / (slot_size * 2 + 1);
+  uint32_t slot_count = fdisk_geometry_slots(sys_partition_sectors);
   uint16_t dir_size;
 
-  // Limit number of freeze slots to 16 bit counters
-  if (slot_count >= 0xffff)
-    slot_count = 0xffff;
-
   dir_size = 1 + (slot_count / 4);
 
   freeze_dir_sectors = dir_size;
@@ -539,7 +561,6 @@ void show_mbr(void)
 char buffer[80];
 unsigned char file_count;
 unsigned long file_offset, next_offset, file_len, first_sector;
-char eightthree[8 + 3 + 1];
 
 typedef struct {
   int model_id;
@@ -584,10 +605,7 @@ void scan_slots(void)
     mega65slot[i].version[0] = 0;
     mega65slot[i].file_count = 0;
     mega65slot[i].file_offset = 0;
-    flash_read512bytes(slot_size * (uint32_t)i);
-#ifdef __CC65__
-    lcopy(0xffd6e00L, (long)sector_buffer, 512);
-#endif
+    flash_read(slot_size * (uint32_t)i, 0x80, (long)sector_buffer);
     for (j = 0; j < 16; j++)
       if (slot_magic[j] != sector_buffer[j])
         break;
@@ -624,9 +642,37 @@ void scan_slots(void)
   }
 }
 
+/*
+  File data is copied from flash to the SD card in batches: a batch is read
+  into a staging area, and then written with a single multi-block write. On
+  the MEGA65 the staging area is in upper RAM, so the batches can be much
+  bigger than multi_sector_buffer. (Flash reads go through the SD
+  controller too, so a read and a write can never actually overlap.)
+*/
+#ifdef __CC65__
+#define POPULATE_STAGING_ADDRESS STAGING_ADDRESS
+#define POPULATE_BATCH_SECTORS STAGING_SECTORS
+#else
+#define POPULATE_STAGING_ADDRESS ((long)multi_sector_buffer)
+#define POPULATE_BATCH_SECTORS MULTI_SECTOR_COUNT
+#endif
+
+/*
+  Files are created a batch at a time with fat32_create_contiguous_files(),
+  so that the FAT and directory sectors they share are written once per
+  batch, rather than once per file.
+*/
+#ifdef __CC65__
+#define POPULATE_MANIFEST_FILES 8
+#else
+#define POPULATE_MANIFEST_FILES 64
+#endif
+fat32_file_t populate_manifest[POPULATE_MANIFEST_FILES];
+unsigned long populate_data_offset[POPULATE_MANIFEST_FILES];
+
 char populate_file_system(unsigned char slot)
 {
-  unsigned char i, j, k;
+  unsigned char i, j, n;
   char *pos;
 
   if (!mega65slot[slot].version[0] || !mega65slot[slot].file_count)
@@ -644,70 +690,78 @@ char populate_file_system(unsigned char slot)
   screen_hex(screen_line_address - 48, file_offset);
 #endif
 
-  for (i = 0; i < file_count; i++) {
-    flash_read512bytes(file_offset);
+  for (i = 0; i < file_count; i += n) {
+    // Read the headers of the next batch of files
+    for (n = 0; n < POPULATE_MANIFEST_FILES && i + n < file_count; n++) {
+      // File header: next offset, length, and a 32 byte name
+      flash_read(file_offset, 40, (long)sector_buffer);
+      sector_buffer[40] = 0;
 #ifdef __CC65__
-    next_offset = slot * slot_size + *(unsigned long *)&sector_buffer[0];
-    file_len = *(unsigned long *)&sector_buffer[4];
+      next_offset = slot * slot_size + *(unsigned long *)&sector_buffer[0];
+      file_len = *(unsigned long *)&sector_buffer[4];
 #else
-    next_offset = slot * slot_size + *(unsigned int *)&sector_buffer[0];
-    file_len = *(unsigned int *)&sector_buffer[4];
+      next_offset = slot * slot_size + *(unsigned int *)&sector_buffer[0];
+      file_len = *(unsigned int *)&sector_buffer[4];
 #endif
-    write_line("Pre-populating file ", 1);
-    for (j = 0; sector_buffer[8 + j]; j++)
-#ifdef __CC65__
-      lpoke(screen_line_address - 59 + j, sector_buffer[8 + j]);
-#else
-      printf("%c", sector_buffer[8+j]);
+      // The name can include directories, e.g. "GAMES/FOO.D81"
+      strcpy(populate_manifest[n].name, (char *)&sector_buffer[8]);
+      populate_manifest[n].size = file_len;
 
-    printf("\n");
-#endif
-#ifdef __CC65__
-    recolour_last_line(8);
-#endif
-    // Prepare "EIGHT  THR" formatted DOS filename for fat32_create_contiguous_file
-    for (j = 0; j < 11; j++)
-      eightthree[j] = ' ';
-    eightthree[11] = 0;
-    k = 0;
-    for (j = 0; sector_buffer[8 + j]; j++) {
-      if (sector_buffer[8 + j] == '.')
-        k = 8;
-      else
-        eightthree[k++] = sector_buffer[8 + j];
-      if (k >= 11)
-        break;
-    }
+      if (!strcmp((char *)&sector_buffer[8], "MEGA65.ROM"))
+        have_rom = 1;
 
-    if (!strcmp((char *)&sector_buffer[8], "MEGA65.ROM"))
-      have_rom = 1;
+      // Skip header
+      populate_data_offset[n] = file_offset + 4 + 4 + 32;
+      file_offset = next_offset;
+    }
 
-    // Skip header
-    file_offset += 4 + 4 + 32;
+    fat32_create_contiguous_files(populate_manifest, n, fat_partition_start + rootdir_sector);
 
-    first_sector = fat32_create_contiguous_file(eightthree, file_len, fat_partition_start + rootdir_sector,
-        fat_partition_start + fat1_sector, fat_partition_start + fat2_sector);
+    for (j = 0; j < n; j++) {
+      strcpy(buffer, populate_manifest[j].name);
+      write_line("Pre-populating file ", 1);
+#ifdef __CC65__
+      for (pos = buffer; *pos; pos++)
+        lpoke(screen_line_address - 59 + (pos - buffer), *pos);
+      recolour_last_line(8);
+#else
+      printf("%s\n", buffer);
+#endif
 
-    if (first_sector) {
-      // Write out file sectors
-      unsigned long addr;
-      for (addr = 0; addr <= file_len; addr += 512) {
-        POKE(0xD020, PEEK(0xD020) + 1);
-        flash_read512bytes(file_offset + addr);
-        sdcard_writesector(first_sector++);
-      }
+      first_sector = populate_manifest[j].first_sector;
+      file_len = populate_manifest[j].size;
+      if (first_sector) {
+        // Write out file sectors, a batch at a time
+        unsigned long addr = 0;
+        unsigned long sectors = (file_len + 511) / 512;
+        unsigned long bytes;
+        unsigned short batch;
+        while (sectors) {
+          POKE(0xD020, PEEK(0xD020) + 1);
+          batch = sectors > POPULATE_BATCH_SECTORS ? POPULATE_BATCH_SECTORS : sectors;
+          bytes = file_len - addr;
+          if (bytes >= batch * 512UL)
+            bytes = batch * 512UL;
+          else
+            // Pad the last sector with zeroes, not the next file's header
+            lfill(POPULATE_STAGING_ADDRESS + bytes, 0, batch * 512UL - bytes);
+          flash_read(populate_data_offset[j] + addr, bytes, POPULATE_STAGING_ADDRESS);
+          addr += bytes;
+          sdcard_writesectors_from(first_sector, batch, POPULATE_STAGING_ADDRESS);
+          first_sector += batch;
+          sectors -= batch;
+        }
 #ifdef __CC65__
-      recolour_last_line(1);
+        recolour_last_line(1);
 #endif
-    }
-    else {
-      write_line("!! Error writing file", 1);
+      }
+      else {
+        write_line("!! Error writing file", 1);
 #ifdef __CC65__
-      recolour_last_line(2);
+        recolour_last_line(2);
 #endif
+      }
     }
-
-    file_offset = next_offset;
   }
 
   return 0;
@@ -901,6 +955,8 @@ next_card:
       sdcard_writesector(0);
       show_mbr();
       write_line("MBR Re-written", 0);
+      // The file system is being kept, so finish off an interrupted session
+      repair_existing_file_system();
       while (1)
         continue;
     }
@@ -925,50 +981,63 @@ next_card:
 
 void open_sdcard_and_retrieve_details(void)
 {
+#ifndef __CC65__
+  const char *cluster_size = getenv("FATCLUSTERSECTORS");
+  const char *align = getenv("FATALIGNSECTORS");
+#endif
+  uint32_t align_sectors;
+  fdisk_geometry_t g;
+
   sdcard_open();
   sdcard_sectors = sdcard_getsize();
   sdcard_readspeed_test();
   show_mbr();
 
-  // Calculate sectors for the system and FAT32 partitions.
-  // This is the size of the card, minus 2,048 (=0x0800) sectors.
-  // The system partition should be sized to be not more than 50% of
-  // the SD card, and probably doesn't need to be bigger than 2GB, which would
-  // allow 1GB for 1,024 1MB freeze images and 1,024 1MB service images.
-  // (note that freeze images might end up being a funny size to allow for all
-  // mem plus a D81 image to be saved. This is all to be determined.)
-  // Simple solution for now: Use 1/2 disk for system partition, or 2GiB, whichever
-  // is smaller.
-  sys_partition_sectors = (sdcard_sectors - 0x0800) >> 1;
-  if (sys_partition_sectors > (2 * 1024UL * (1024UL * 1024UL / 512UL)))
-    sys_partition_sectors = (2 * 1024UL * (1024UL * 1024UL / 512UL));
-  sys_partition_sectors &= 0xfffff800; // round down to nearest 1MB boundary
-  fat_partition_sectors = sdcard_sectors - 0x800 - sys_partition_sectors;
-
-  fat_available_sectors = fat_partition_sectors - reserved_sectors;
+  // The allocation unit size to align to
+  align_sectors = fat_align_sectors;
+#ifndef __CC65__
+  if (align) {
+    unsigned long sectors = strtoul(align, NULL, 0);
+    if (sectors >= 8 && !(sectors & (sectors - 1)))
+      align_sectors = sectors;
+    else
+      fprintf(stderr, "WARNING: Ignoring FATALIGNSECTORS=%s, which must be a power of 2 of at least 8.\n", align);
+  }
+  else if (sdcard_physical_block_size / 512 > align_sectors)
+    align_sectors = sdcard_physical_block_size / 512;
+  if (cluster_size) {
+    unsigned long spc = strtoul(cluster_size, NULL, 0);
+    if (spc >= 1 && spc <= 128 && !(spc & (spc - 1)))
+      requested_sectors_per_cluster = spc;
+    else
+      fprintf(stderr, "WARNING: Ignoring FATCLUSTERSECTORS=%s, which must be a power of 2 from 1 to 128.\n", cluster_size);
+  }
+#endif
 
-  fs_clusters = fat_available_sectors / (sectors_per_cluster);
-  fat_sectors = fs_clusters / (512 / 4);
-  if (fs_clusters % (512 / 4))
-    fat_sectors++;
-  sectors_required = 2 * fat_sectors + ((fs_clusters - 2) * sectors_per_cluster);
-  while (sectors_required > fat_available_sectors) {
-    uint32_t excess_sectors = sectors_required - fat_available_sectors;
-    uint32_t delta = (excess_sectors / (1 + sectors_per_cluster));
-    if (delta < 1)
-      delta = 1;
+  // Work out the sizes of the system and FAT32 partitions, and of the
+  // FAT32 file system. See fdisk_geometry.c.
+  if (!fdisk_geometry_solve(sdcard_sectors, requested_sectors_per_cluster, align_sectors, &g)) {
 #ifndef __CC65__
-    fprintf(
-        stderr, "%d clusters would take %d too many sectors.\r\n", fs_clusters, sectors_required - fat_available_sectors);
+    fprintf(stderr, "WARNING: The card is too small for a valid FAT32 file system (%u clusters).\n",
+        g.fs_clusters > 2 ? g.fs_clusters - 2 : 0);
+#else
+    write_line("WARNING: Card is too small for FAT32.", 1);
+    recolour_last_line(2);
 #endif
-    fs_clusters -= delta;
-    fat_sectors = fs_clusters / (512 / 4);
-    if (fs_clusters % (512 / 4))
-      fat_sectors++;
-    sectors_required = 2 * fat_sectors + ((fs_clusters - 2) * sectors_per_cluster);
   }
+  fat_partition_start = g.fat_partition_start;
+  fat_partition_sectors = g.fat_partition_sectors;
+  sys_partition_start = g.sys_partition_start;
+  sys_partition_sectors = g.sys_partition_sectors;
+  sectors_per_cluster = g.sectors_per_cluster;
+  reserved_sectors = g.reserved_sectors;
+  fat_sectors = g.fat_sectors;
+  fs_clusters = g.fs_clusters;
+  fat_available_sectors = fat_partition_sectors - reserved_sectors;
+
 #ifndef __CC65__
-  fprintf(stderr, "VFAT32 PARTITION HAS $%x SECTORS ($%x AVAILABLE)\r\n", fat_partition_sectors, fat_available_sectors);
+  fprintf(stderr, "VFAT32 PARTITION HAS $%x SECTORS ($%x AVAILABLE), %d SECTORS PER CLUSTER\r\n", fat_partition_sectors,
+      fat_available_sectors, sectors_per_cluster);
 #else
   // Tell use how many sectors available for partition
   write_line("", 0);
@@ -980,19 +1049,72 @@ void open_sdcard_and_retrieve_details(void)
   screen_hex(screen_line_address - 78, fat_partition_sectors);
 #endif
 
-  fat_partition_start = 0x00000800;
-  sys_partition_start = fat_partition_start + fat_partition_sectors;
-
   fat1_sector = reserved_sectors;
   fat2_sector = fat1_sector + fat_sectors;
   rootdir_sector = fat2_sector + fat_sectors;
-  fs_data_sectors = fs_clusters * sectors_per_cluster;
+  fs_data_sectors = g.data_sectors;
+
+  // Opening a card never writes to it: an interrupted session is only
+  // reported here, and repaired once the user has chosen to keep the
+  // file system (FIX MBR)
+  if (existing_file_system_unclean()) {
+    write_line("File system was not closed cleanly: FAT2 may be out of date.", 1);
+#ifdef __CC65__
+    recolour_last_line(7);
+#endif
+  }
+}
+
+/*
+  Returns non-zero if the card already holds a file system laid out just as
+  we would lay it out, and the session that last wrote to it was cut short
+  before FAT2 was brought up to date (see fdisk_fat32.c). A file system
+  laid out any other way doesn't count, as the FATs would not be where we
+  expect them. Only reads from the card.
+*/
+unsigned char existing_file_system_unclean(void)
+{
+  sdcard_readsector(fat_partition_start);
+  if (sector_buffer[510] != 0x55 || sector_buffer[511] != 0xaa || memcmp(&sector_buffer[0x52], "FAT32   ", 8))
+    return 0;
+  if (sector_buffer[0x0d] != sectors_per_cluster
+      || (sector_buffer[0x0e] | ((uint16_t)sector_buffer[0x0f] << 8)) != reserved_sectors
+      || *(uint32_t *)&sector_buffer[0x24] != fat_sectors)
+    return 0;
+
+  // Anything cached from a previous card is stale
+  sector_cache_invalidate();
+  return !fat32_mirror_is_clean();
+}
+
+// Bring FAT2 and FSInfo up to date, if existing_file_system_unclean() says they need it
+void repair_existing_file_system(void)
+{
+  if (!existing_file_system_unclean())
+    return;
+
+  free_bitmap_invalidate();
+  dir_index_invalidate();
+  fat32_mirror_begin();
+  fat32_fsinfo_begin(FSINFO_UNKNOWN, FSINFO_UNKNOWN);
+  if (fat32_mirror_repair()) {
+    write_line("Repaired FAT2 after an interrupted session.", 1);
+    sector_cache_flush();
+    sdcard_flush();
+  }
 }
 
 
 int format_disk(void)
 {
   unsigned char key;
+
+  // Anything cached from a previous card (or format) is now stale
+  sector_cache_invalidate();
+  free_bitmap_invalidate();
+  dir_index_invalidate();
+  fat32_mirror_begin();
+
   // MBR is always the first sector of a disk
 #ifdef __CC65__
   write_line("", 0);
@@ -1047,8 +1169,8 @@ int format_disk(void)
   }
 
   write_line("Writing FAT Boot Sector...", 1);
-  // Partition starts at fixed position of sector 2048, i.e., 1MB
-  build_dosbootsector(fat_partition_sectors, fat_sectors);
+  // Partition starts at 1MB, or the first allocation unit
+  build_dosbootsector(fat_partition_sectors, fat_sectors, sectors_per_cluster, reserved_sectors);
   sdcard_writesector(fat_partition_start);
   sdcard_writesector(fat_partition_start + 6); // Backup boot sector at partition + 6
 
@@ -1057,6 +1179,8 @@ int format_disk(void)
   build_fs_information_sector(fs_clusters);
   sdcard_writesector(fat_partition_start + 1);
   sdcard_writesector(fat_partition_start + 7);
+  // The FAT32 code keeps these up to date from here on
+  fat32_fsinfo_begin(fs_clusters - 3, 3);
 
   // FATs
 #ifndef __CC65__
@@ -1067,15 +1191,27 @@ int format_disk(void)
   screen_hex(screen_line_address - 80 + 32, fat2_sector * 512);
 #endif
   build_empty_fat();
-  sdcard_writesector(fat_partition_start + fat1_sector);
-  sdcard_writesector(fat_partition_start + fat2_sector);
+  fat32_write_fat_sector(0);
 
 #ifdef __CC65__
   write_line("Writing Root Directory...", 1);
 #endif
-  // Root directory
+  // Root directory: volume label followed by the rest of the (empty) cluster
   build_root_dir(volume_name);
-  sdcard_writesector(fat_partition_start + rootdir_sector);
+  {
+    uint16_t n = 0, batch;
+    lcopy((long)sector_buffer, (long)multi_sector_buffer, 512);
+    lfill((long)multi_sector_buffer + 512, 0, (MULTI_SECTOR_COUNT - 1) * 512);
+    while (n < sectors_per_cluster) {
+      batch = sectors_per_cluster - n;
+      if (batch > MULTI_SECTOR_COUNT)
+        batch = MULTI_SECTOR_COUNT;
+      sdcard_writesectors(fat_partition_start + rootdir_sector + n, batch, multi_sector_buffer);
+      // Only the first sector holds the volume label
+      lfill((long)multi_sector_buffer, 0, 512);
+      n += batch;
+    }
+  }
 
 #ifdef __CC65__
   write_line("", 0);
@@ -1085,10 +1221,9 @@ int format_disk(void)
   // Make sure all other sectors are empty
 #if 1
   sdcard_erase(fat_partition_start + 1 + 1, fat_partition_start + 6 - 1);
-  sdcard_erase(fat_partition_start + 6 + 1, fat_partition_start + fat1_sector - 1);
+  sdcard_erase(fat_partition_start + 7 + 1, fat_partition_start + fat1_sector - 1);
   sdcard_erase(fat_partition_start + fat1_sector + 1, fat_partition_start + fat2_sector - 1);
   sdcard_erase(fat_partition_start + fat2_sector + 1, fat_partition_start + rootdir_sector - 1);
-  sdcard_erase(fat_partition_start + rootdir_sector + 1, fat_partition_start + rootdir_sector + 1 + sectors_per_cluster - 1);
 #endif
 
   /* Check if flash slot 0 contains embedded files that we should write to the SD card.
@@ -1170,8 +1305,7 @@ int format_disk(void)
       if (dosname[i] >= 'a' && dosname[i] <= 'z')
         dosname[i] -= 0x20;
 
-    unsigned int first_sector = fat32_create_contiguous_file(dosname, st.st_size, fat_partition_start + rootdir_sector,
-        fat_partition_start + fat1_sector, fat_partition_start + fat2_sector);
+    unsigned int first_sector = fat32_create_contiguous_file(dosname, st.st_size, fat_partition_start + rootdir_sector);
     if (first_sector) {
       // Write out sectors
       unsigned long addr;
@@ -1185,6 +1319,28 @@ int format_disk(void)
   }
 #endif
 
+  // FSInfo (and its backup) get the free cluster count and next free
+  // cluster after any files we added
+  fat32_write_fsinfo();
+
+  // Copy the FAT updates across to FAT2, if that was put off
+  fat32_mirror_finish();
+
+  // Make sure everything has actually reached the card
+  sector_cache_flush();
+  sdcard_flush();
+
+  if (sdcard_verify_mode == SDCARD_VERIFY_DEFERRED) {
+    write_line("Verifying written sectors...", 1);
+    if (sdcard_verify_deferred()) {
+      write_line("!! Verify errors: the card may be faulty", 1);
+#ifdef __CC65__
+      recolour_last_line(2);
+#endif
+    }
+  }
+  sdcard_report_stats();
+
 #ifdef __CC65__
 
   POKE(0xd020U, 6);
@@ -0,0 +1,178 @@
+/*
+  Small write-back sector cache that sits between the FAT32 code and the
+  HAL. The FAT code keeps coming back to the same few FAT and directory
+  sectors (every cluster probed, every link followed), so those reads are
+  served from memory, and repeated updates of a sector only reach the card
+  once, when the cache is flushed (or the sector is evicted).
+
+  On the MEGA65 the cache is write-through instead, as the sectors are
+  kept in upper RAM, and the writes of both FAT copies still go out
+  straight away.
+
+  Sectors are moved in and out of sector_buffer, just like the HAL calls
+  that they replace. Code that bypasses the cache for bulk transfers must
+  call sector_cache_sync_range() first.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fdisk_hal.h"
+#include "fdisk_memory.h"
+#include "fdisk_cache.h"
+
+#define SECTOR_CACHE_SLOTS 64
+
+#ifdef __CC65__
+#define SECTOR_CACHE_WRITE_THROUGH
+#define sector_cache_data(N) (SECTOR_CACHE_ADDRESS + ((long)(N) << 9))
+#else
+uint8_t sector_cache_storage[SECTOR_CACHE_SLOTS][512];
+#define sector_cache_data(N) ((long)sector_cache_storage[N])
+#endif
+
+uint32_t sector_cache_sector[SECTOR_CACHE_SLOTS];
+uint16_t sector_cache_last_used[SECTOR_CACHE_SLOTS];
+uint8_t sector_cache_flags[SECTOR_CACHE_SLOTS];
+uint16_t sector_cache_clock = 0;
+
+#define SECTOR_CACHE_VALID 0x01
+#define SECTOR_CACHE_DIRTY 0x02
+
+static unsigned char sector_cache_find(const uint32_t sector_number)
+{
+  unsigned char i;
+
+  for (i = 0; i < SECTOR_CACHE_SLOTS; i++)
+    if ((sector_cache_flags[i] & SECTOR_CACHE_VALID) && sector_cache_sector[i] == sector_number)
+      return i;
+  return SECTOR_CACHE_SLOTS;
+}
+
+static void sector_cache_touch(const unsigned char slot)
+{
+  unsigned char i;
+
+  // Start again from the bottom when the clock wraps, so that ages stay
+  // comparable.
+  if (!++sector_cache_clock) {
+    for (i = 0; i < SECTOR_CACHE_SLOTS; i++)
+      sector_cache_last_used[i] = 0;
+    sector_cache_clock = 1;
+  }
+  sector_cache_last_used[slot] = sector_cache_clock;
+}
+
+static void sector_cache_write_back(const unsigned char slot)
+{
+  lcopy(sector_cache_data(slot), (long)multi_sector_buffer, 512);
+  sdcard_writesectors(sector_cache_sector[slot], 1, multi_sector_buffer);
+  sector_cache_flags[slot] &= ~SECTOR_CACHE_DIRTY;
+}
+
+// Find a slot for a new sector, writing back the least recently used one
+// if it has to go
+static unsigned char sector_cache_allocate(const uint32_t sector_number)
+{
+  unsigned char i, slot = 0;
+
+  for (i = 0; i < SECTOR_CACHE_SLOTS; i++) {
+    if (!(sector_cache_flags[i] & SECTOR_CACHE_VALID)) {
+      slot = i;
+      break;
+    }
+    if (sector_cache_last_used[i] < sector_cache_last_used[slot])
+      slot = i;
+  }
+  if (sector_cache_flags[slot] & SECTOR_CACHE_DIRTY)
+    sector_cache_write_back(slot);
+
+  sector_cache_sector[slot] = sector_number;
+  sector_cache_flags[slot] = SECTOR_CACHE_VALID;
+  return slot;
+}
+
+void sector_cache_readsector(const uint32_t sector_number)
+{
+  unsigned char slot = sector_cache_find(sector_number);
+
+  if (slot == SECTOR_CACHE_SLOTS) {
+    sdcard_readsector(sector_number);
+    slot = sector_cache_allocate(sector_number);
+    lcopy((long)sector_buffer, sector_cache_data(slot), 512);
+  }
+  else
+    lcopy(sector_cache_data(slot), (long)sector_buffer, 512);
+  sector_cache_touch(slot);
+}
+
+void sector_cache_writesector(const uint32_t sector_number)
+{
+  unsigned char slot = sector_cache_find(sector_number);
+
+  if (slot == SECTOR_CACHE_SLOTS)
+    slot = sector_cache_allocate(sector_number);
+  lcopy((long)sector_buffer, sector_cache_data(slot), 512);
+  sector_cache_touch(slot);
+#ifdef SECTOR_CACHE_WRITE_THROUGH
+  sdcard_writesector(sector_number);
+#else
+  sector_cache_flags[slot] |= SECTOR_CACHE_DIRTY;
+#endif
+}
+
+/*
+  Write back all dirty sectors, lowest sector number first, gathering
+  consecutive sectors (e.g., neighbouring FAT sectors) into a single
+  multi-sector write.
+*/
+void sector_cache_flush(void)
+{
+  unsigned char i, slot, count;
+  uint32_t next;
+
+  while (1) {
+    slot = SECTOR_CACHE_SLOTS;
+    for (i = 0; i < SECTOR_CACHE_SLOTS; i++)
+      if ((sector_cache_flags[i] & SECTOR_CACHE_DIRTY)
+          && (slot == SECTOR_CACHE_SLOTS || sector_cache_sector[i] < sector_cache_sector[slot]))
+        slot = i;
+    if (slot == SECTOR_CACHE_SLOTS)
+      return;
+
+    count = 0;
+    next = sector_cache_sector[slot];
+    while (slot != SECTOR_CACHE_SLOTS && (sector_cache_flags[slot] & SECTOR_CACHE_DIRTY) && count < MULTI_SECTOR_COUNT) {
+      lcopy(sector_cache_data(slot), (long)&multi_sector_buffer[count * 512], 512);
+      sector_cache_flags[slot] &= ~SECTOR_CACHE_DIRTY;
+      count++;
+      slot = sector_cache_find(next + count);
+    }
+    sdcard_writesectors(next, count, multi_sector_buffer);
+  }
+}
+
+// Write back and forget any cached sectors in the given range
+void sector_cache_sync_range(const uint32_t first_sector, const uint32_t count)
+{
+  unsigned char i;
+
+  for (i = 0; i < SECTOR_CACHE_SLOTS; i++) {
+    if (!(sector_cache_flags[i] & SECTOR_CACHE_VALID))
+      continue;
+    if (sector_cache_sector[i] < first_sector || sector_cache_sector[i] - first_sector >= count)
+      continue;
+    if (sector_cache_flags[i] & SECTOR_CACHE_DIRTY)
+      sector_cache_write_back(i);
+    sector_cache_flags[i] = 0;
+  }
+}
+
+void sector_cache_invalidate(void)
+{
+  unsigned char i;
+
+  for (i = 0; i < SECTOR_CACHE_SLOTS; i++)
+    sector_cache_flags[i] = 0;
+  sector_cache_clock = 0;
+}
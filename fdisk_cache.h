@@ -0,0 +1,5 @@
+void sector_cache_readsector(const uint32_t sector_number);
+void sector_cache_writesector(const uint32_t sector_number);
+void sector_cache_sync_range(const uint32_t first_sector, const uint32_t count);
+void sector_cache_flush(void);
+void sector_cache_invalidate(void);
@@ -1,9 +1,13 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "fdisk_hal.h"
 #include "fdisk_memory.h"
 #include "fdisk_screen.h"
+#include "fdisk_cache.h"
+#include "fdisk_fat_scan.h"
+#include "fdisk_fat32.h"
 #ifdef __CC65__
 #include "ascii.h"
 #endif
@@ -15,6 +19,7 @@ extern uint32_t reserved_sectors;
 extern uint8_t sectors_per_cluster;
 extern uint32_t fat_sectors;
 extern uint32_t fat_partition_start;
+extern uint32_t fs_clusters;
 #define fat_copies 2
 #define sectors_per_fat fat_sectors
 #define root_dir_cluster 2
@@ -127,7 +132,6 @@ unsigned char unbcd(unsigned char in)
 
 void getrtc(struct m65_tm *tm)
 {
-#ifdef __CC65__
   if (!tm)
     return;
 
@@ -140,6 +144,7 @@ void getrtc(struct m65_tm *tm)
   tm->tm_wday = 0;
   tm->tm_isdst = 0;
 
+#ifdef __CC65__
   switch (detect_target()) {
   case TARGET_MEGA65R2:
   case TARGET_MEGA65R3:
@@ -172,353 +177,1087 @@ void getrtc(struct m65_tm *tm)
 #endif
 }
 
-unsigned long fat32_follow_cluster(unsigned long cluster)
+/*
+  FSInfo free cluster count and next free cluster hint. They are set when
+  the file system is made, and then kept up to date as clusters are
+  allocated, so FSInfo (and its backup) only need to be written once, at
+  the end of the session. 0xffffffff means unknown, as in FSInfo itself.
+*/
+uint32_t fsinfo_free_count = FSINFO_UNKNOWN;
+uint32_t fsinfo_next_free = FSINFO_UNKNOWN;
+
+void fat32_fsinfo_begin(const uint32_t free_count, const uint32_t next_free)
 {
-  unsigned long r;
-  // Read out the cluster number from the FAT
-  sdcard_readsector(fat1_sector + (cluster / 128));
-  r = *((unsigned long *)&sector_buffer[(cluster & 127) << 2]);
-  return r;
+  fsinfo_free_count = free_count;
+  fsinfo_next_free = next_free;
 }
 
-unsigned long fat32_allocate_cluster(unsigned long cluster)
+// Write the tracked values to FSInfo and its backup
+void fat32_write_fsinfo(void)
 {
-  unsigned long r;
-  unsigned long fat_sector_num;
-  unsigned short i;
+  sector_cache_readsector(fat_partition_start + 1);
+  *((uint32_t *)&sector_buffer[0x1e8]) = fsinfo_free_count;
+  *((uint32_t *)&sector_buffer[0x1ec]) = fsinfo_next_free;
+  sector_cache_writesector(fat_partition_start + 1);
+  sector_cache_writesector(fat_partition_start + 7);
+}
 
-  // Find free cluster
-  for (fat_sector_num = 0; fat_sector_num <= (fat2_sector - fat1_sector); fat_sector_num++) {
-    sdcard_readsector(fat1_sector + fat_sector_num);
-    for (i = 0; i < 512; i += 4) {
-      if (sector_buffer[i])
-        continue;
-      if (sector_buffer[i + 3])
-        continue;
-      if (sector_buffer[i + 1])
-        continue;
-      if (sector_buffer[i + 2])
-        continue;
+/*
+  Free-cluster bitmap: one bit per cluster, set if the cluster is in use.
+  It is built with one sequential pass over FAT1, and then kept up to date
+  as clusters are allocated, so looking for a run of free clusters does not
+  have to go back to the FAT for every candidate cluster.
+
+  On the MEGA65 the bitmap lives in upper RAM, and covers a window of 512K
+  clusters (2GB with 4KB clusters, more with bigger ones). If a run can't be found there, the
+  window is moved along.
+*/
+#define FREE_BITMAP_CHUNK 64
+#ifdef __CC65__
+#define FREE_BITMAP_WINDOW (FREE_BITMAP_BYTES * 8UL)
+uint8_t free_bitmap_chunk[FREE_BITMAP_CHUNK];
+#else
+uint8_t *free_bitmap = NULL;
+uint32_t free_bitmap_allocated = 0;
+#endif
+uint32_t free_bitmap_start = 0;
+uint32_t free_bitmap_clusters = 0;
+unsigned char free_bitmap_valid = 0;
+
+void free_bitmap_invalidate(void)
+{
+  free_bitmap_valid = 0;
+}
+
+// Get len bytes of the bitmap from the given byte offset into the window
+static uint8_t *free_bitmap_fetch(const uint32_t byte_offset, const unsigned short len)
+{
+#ifdef __CC65__
+  lcopy(FREE_BITMAP_ADDRESS + byte_offset, (long)free_bitmap_chunk, len);
+  return free_bitmap_chunk;
+#else
+  return free_bitmap + byte_offset;
+#endif
+}
+
+static void free_bitmap_store(const uint32_t byte_offset, const unsigned short len)
+{
+#ifdef __CC65__
+  lcopy((long)free_bitmap_chunk, FREE_BITMAP_ADDRESS + byte_offset, len);
+#endif
+}
+
+#ifndef __CC65__
+// FAT1 is read this many sectors at a time for the scan threads
+#define FAT_SCAN_SEGMENT_SECTORS 16384
+
+/*
+  Scan count FAT1 entries from first_cluster (a multiple of 128). The FAT
+  is read here in big segments, as the sdcard backends are not thread safe,
+  and each segment is then split between the scan threads.
+*/
+static void fat32_scan_fat(
+    const uint32_t first_cluster, const uint32_t count, uint8_t *bitmap, fat_scan_summary_t *summary)
+{
+  static uint8_t *segment = NULL;
+  fat_scan_summary_t part;
+  uint32_t done = 0, n;
+
+  if (!segment) {
+    segment = malloc(FAT_SCAN_SEGMENT_SECTORS * 512);
+    if (!segment) {
+      perror("malloc");
+      exit(-1);
     }
-    if (i < 512) {
-      // Found one
-      r = fat_sector_num * 128 + (i >> 2);
-      *((unsigned long *)&sector_buffer[i]) = cluster;
-      sdcard_writesector(fat1_sector + fat_sector_num);
-      sdcard_writesector(fat2_sector + fat_sector_num);
-      return r;
+  }
+  sector_cache_sync_range(fat_partition_start + fat1_sector + first_cluster / 128, (count + 127) / 128);
+  while (done < count) {
+    n = count - done;
+    if (n > FAT_SCAN_SEGMENT_SECTORS * 128)
+      n = FAT_SCAN_SEGMENT_SECTORS * 128;
+    sdcard_readsectors(fat_partition_start + fat1_sector + (first_cluster + done) / 128, (n + 127) / 128, segment);
+    fat_scan_parallel(segment, first_cluster + done, n, bitmap ? bitmap + done / 8 : NULL, done ? &part : summary);
+    if (done)
+      fat_scan_combine(summary, &part);
+    done += n;
+  }
+}
+#endif
+
+// Fill the bitmap window that starts at the given cluster (a multiple of 128) from FAT1
+static void free_bitmap_build(const uint32_t first_cluster)
+{
+#ifdef __CC65__
+  uint32_t fat_sector, last_fat_sector, byte_offset = 0, c;
+  unsigned short n, batch, i, used;
+  uint8_t *p, *entries;
+#else
+  fat_scan_summary_t summary;
+  uint32_t c;
+#endif
+
+  free_bitmap_start = first_cluster;
+  free_bitmap_clusters = fs_clusters - first_cluster;
+#ifndef __CC65__
+  // Whole FAT sectors are converted at a time
+  if (free_bitmap_allocated < (fs_clusters + 127) / 128 * 16) {
+    free(free_bitmap);
+    free_bitmap_allocated = (fs_clusters + 127) / 128 * 16;
+    free_bitmap = malloc(free_bitmap_allocated);
+    if (!free_bitmap) {
+      perror("malloc");
+      exit(-1);
     }
   }
 
-  return 0;
+  fat32_scan_fat(first_cluster, free_bitmap_clusters, free_bitmap, &summary);
+  // The end of the last byte is beyond the file system
+  for (c = free_bitmap_clusters; c & 7; c++)
+    free_bitmap[c >> 3] |= 1 << (c & 7);
+#else
+  if (free_bitmap_clusters > FREE_BITMAP_WINDOW)
+    free_bitmap_clusters = FREE_BITMAP_WINDOW;
+
+  fat_sector = fat_partition_start + fat1_sector + first_cluster / 128;
+  last_fat_sector = fat_partition_start + fat1_sector + (first_cluster + free_bitmap_clusters - 1) / 128;
+  sector_cache_sync_range(fat_sector, last_fat_sector - fat_sector + 1);
+  c = first_cluster;
+  while (fat_sector <= last_fat_sector) {
+    batch = last_fat_sector - fat_sector + 1 > MULTI_SECTOR_COUNT ? MULTI_SECTOR_COUNT : last_fat_sector - fat_sector + 1;
+    sdcard_readsectors(fat_sector, batch, multi_sector_buffer);
+    for (n = 0; n < batch; n++) {
+      // 128 FAT entries make 16 bytes of bitmap. Skip over runs of free
+      // entries, and set the bits for runs of used ones.
+      entries = &multi_sector_buffer[n * 512];
+      p = free_bitmap_fetch(byte_offset, 16);
+      for (i = 0; i < 16; i++)
+        p[i] = 0;
+      i = 0;
+      while (i < 128) {
+        i += fat_scan_zero_run(entries, i, 128);
+        used = i + fat_scan_first_zero(entries + i * 4, 128 - i);
+        while (i < used) {
+          if (!(i & 7) && i + 8 <= used) {
+            p[i >> 3] = 0xff;
+            i += 8;
+            continue;
+          }
+          p[i >> 3] |= 1 << (i & 7);
+          i++;
+        }
+      }
+      // The end of the last FAT sector is beyond the file system
+      for (i = 0; i < 128; i++)
+        if (c + i >= fs_clusters)
+          p[i >> 3] |= 1 << (i & 7);
+      c += 128;
+      free_bitmap_store(byte_offset, 16);
+      byte_offset += 16;
+    }
+    fat_sector += batch;
+  }
+#endif
+  free_bitmap_valid = 1;
 }
 
-#ifndef __CC65__
-int are_there_gaps_between_files(void)
+// Mark clusters as being in use
+static void free_bitmap_mark(const uint32_t first_cluster, const uint32_t count)
 {
-  unsigned long fat_sector_num = 0;
-  int found_unallocated_cluster = 0;
-
-  for (fat_sector_num = 0; fat_sector_num < (fat2_sector - fat1_sector); fat_sector_num++) {
-    sdcard_readsector(fat_partition_start + fat1_sector + fat_sector_num);
-    for (int j = 0; j < 512; j+=4) {
-      int cval = sector_buffer[j] +
-        (sector_buffer[j+1] << 8) +
-        (sector_buffer[j+2] << 16) +
-        (sector_buffer[j+3] << 24);
-      if (!found_unallocated_cluster && cval == 0) {
-        found_unallocated_cluster = 1;
-        continue;
-      }
+  uint32_t c = first_cluster - free_bitmap_start, last = c + count - 1;
+  uint32_t byte_offset;
+  unsigned short len;
+  uint8_t *p;
 
-      if (found_unallocated_cluster && cval != 0) {
-        return 1;
-      }
+  if (!free_bitmap_valid || first_cluster < free_bitmap_start || c >= free_bitmap_clusters)
+    return;
+  if (last >= free_bitmap_clusters)
+    last = free_bitmap_clusters - 1;
+  while (c <= last) {
+    byte_offset = c / 8;
+    len = last / 8 - byte_offset + 1 > FREE_BITMAP_CHUNK ? FREE_BITMAP_CHUNK : last / 8 - byte_offset + 1;
+    p = free_bitmap_fetch(byte_offset, len);
+    while (c <= last && c / 8 - byte_offset < len) {
+      p[c / 8 - byte_offset] |= 1 << (c & 7);
+      c++;
     }
+    free_bitmap_store(byte_offset, len);
   }
-  return 0;
 }
-#endif
 
-unsigned long find_free_cluster(unsigned long first_cluster)
+// Take clusters for a file or directory: out of the bitmap, and off the free count
+static void fat32_claim_clusters(const uint32_t first_cluster, const uint32_t count)
 {
-  unsigned long cluster = 0;
+  free_bitmap_mark(first_cluster, count);
+  if (fsinfo_free_count != FSINFO_UNKNOWN)
+    fsinfo_free_count -= count;
+  fsinfo_next_free = first_cluster + count < fs_clusters ? first_cluster + count : 2;
+}
 
-  int retVal = 0;
+/*
+  Find a run of free clusters of the given length, and return the first
+  of them, or 0 if there is no such run.
+*/
+unsigned long find_contiguous_clusters(unsigned long total_clusters)
+{
+  uint32_t i, bytes, run, run_start = 0, from;
+  unsigned short len, j;
+  unsigned char bit, wrapped;
+  uint8_t *p, b;
+
+  // Start looking at the next free cluster hint, and only go back to the
+  // start of the disk if there is no room after it
+  from = fsinfo_next_free < fs_clusters ? fsinfo_next_free & ~7UL : 0;
+  wrapped = !from;
+#ifdef __CC65__
+  if (!free_bitmap_valid || from < free_bitmap_start || from - free_bitmap_start >= free_bitmap_clusters)
+    free_bitmap_build(from & ~127UL);
+#else
+  if (!free_bitmap_valid)
+    free_bitmap_build(0);
+#endif
 
-  do {
-    unsigned long i, o;
-
-    i = first_cluster / (512 / 4);
-    o = (first_cluster % (512 / 4)) * 4;
-
-    for (; i < sectors_per_fat; i++) {
-      // Read FAT sector
-      //      printf("Checking FAT sector $%x for free clusters.\n",i);
-      sdcard_readsector(fat_partition_start + fat1_sector + i);
-
-      // Search for free sectors
-      for (; o < 512; o += 4) {
-        if (!(sector_buffer[o] | sector_buffer[o + 1] | sector_buffer[o + 2] | sector_buffer[o + 3])) {
-          // Found a free cluster.
-          cluster = i * (512 / 4) + (o / 4);
-          // printf("cluster sector %d, offset %d yields cluster %d\n",i,o,cluster);
-          break;
+  while (1) {
+    run = 0;
+    bytes = (free_bitmap_clusters + 7) / 8;
+    i = from > free_bitmap_start ? (from - free_bitmap_start) / 8 : 0;
+    for (; i < bytes; i += len) {
+      len = bytes - i > FREE_BITMAP_CHUNK ? FREE_BITMAP_CHUNK : bytes - i;
+      p = free_bitmap_fetch(i, len);
+      for (j = 0; j < len; j++) {
+        b = p[j];
+        if (b == 0xff) {
+          run = 0;
+          continue;
+        }
+        for (bit = 0; bit < 8; bit++) {
+          if (b & (1 << bit)) {
+            run = 0;
+            continue;
+          }
+          if (!run)
+            run_start = (i + j) * 8 + bit;
+          if (++run >= total_clusters)
+            return free_bitmap_start + run_start;
         }
       }
-      o = 0;
+    }
 
-      if (cluster || retVal)
-        break;
+    if (free_bitmap_start + free_bitmap_clusters >= fs_clusters) {
+      if (wrapped)
+        return 0;
+      // Nothing after the hint, so try again from the start
+      wrapped = 1;
+      from = 0;
+#ifdef __CC65__
+      if (free_bitmap_start)
+        free_bitmap_build(0);
+#endif
+      continue;
     }
 
-    // printf("I believe cluster $%x is free.\n",cluster);
+    // Try the next window (only on the MEGA65), keeping any free run at
+    // the end of this one
+    i = (free_bitmap_start + (run ? run_start : free_bitmap_clusters)) & ~127UL;
+    if (i <= free_bitmap_start)
+      return 0;
+    free_bitmap_build(i);
+  }
+}
 
-    retVal = cluster;
-  } while (0);
+/*
+  FAT2 mirroring. In deferred mode, FAT updates go to FAT1 only, and the
+  range of FAT sectors touched is tracked. At the end of the session that
+  range is copied to FAT2 in one sequential pass, rather than the card
+  being made to jump between the two FATs for every update.
+
+  While FAT2 is out of date, the clean shutdown bit in FAT1 entry 1 is
+  kept cleared, so a card whose session was interrupted can be spotted (by
+  fat32_mirror_repair(), or by any FAT32 checker) and FAT2 rebuilt.
+*/
+#define FAT_CLEAN_SHUTDOWN 0x08000000UL
+uint8_t fat_mirror_mode = FAT_MIRROR_DEFAULT;
+uint32_t fat_mirror_first = 1;
+uint32_t fat_mirror_last = 0;
 
-  return retVal;
+static void fat32_mirror_note(const uint32_t fat_sector_num, const uint32_t count)
+{
+  if (fat_mirror_first > fat_mirror_last) {
+    // First update of the session: FAT2 is out of date from here on
+    fat_mirror_first = fat_sector_num;
+    fat_mirror_last = fat_sector_num + count - 1;
+    sector_cache_readsector(fat_partition_start + fat1_sector);
+    *((uint32_t *)&sector_buffer[4]) &= ~FAT_CLEAN_SHUTDOWN;
+    sector_cache_writesector(fat_partition_start + fat1_sector);
+    // The cache is write-back on the host, and FAT1 is also written around
+    // it, so make sure the card says "not clean" before any of that. This
+    // flush is silent: the stats are only reported at the end of a format.
+    sector_cache_sync_range(fat_partition_start + fat1_sector, 1);
+    sdcard_flush();
+    return;
+  }
+  if (fat_sector_num < fat_mirror_first)
+    fat_mirror_first = fat_sector_num;
+  if (fat_sector_num + count - 1 > fat_mirror_last)
+    fat_mirror_last = fat_sector_num + count - 1;
 }
 
-int is_free_cluster(unsigned int cluster)
+// Set the clean shutdown bit in the first sector of both FATs
+static void fat32_mark_clean(void)
 {
-  int i, o;
-  i = cluster / (512 / 4);
-  o = cluster % (512 / 4) * 4;
-
-  sdcard_readsector(fat_partition_start + fat1_sector + i);
+  sector_cache_readsector(fat_partition_start + fat1_sector);
+  *((uint32_t *)&sector_buffer[4]) |= FAT_CLEAN_SHUTDOWN;
+  sector_cache_writesector(fat_partition_start + fat1_sector);
+  sector_cache_writesector(fat_partition_start + fat2_sector);
+}
 
-  if (!(sector_buffer[o] | sector_buffer[o + 1] | sector_buffer[o + 2] | sector_buffer[o + 3])) {
-    return 1;
+// Copy count sectors of FAT1 to FAT2
+static void fat32_mirror_copy(uint32_t fat_sector_num, uint32_t count)
+{
+  unsigned short batch;
+
+  sector_cache_sync_range(fat_partition_start + fat1_sector + fat_sector_num, count);
+  sector_cache_sync_range(fat_partition_start + fat2_sector + fat_sector_num, count);
+  while (count) {
+    batch = count > MULTI_SECTOR_COUNT ? MULTI_SECTOR_COUNT : count;
+    sdcard_readsectors(fat_partition_start + fat1_sector + fat_sector_num, batch, multi_sector_buffer);
+    sdcard_writesectors(fat_partition_start + fat2_sector + fat_sector_num, batch, multi_sector_buffer);
+    fat_sector_num += batch;
+    count -= batch;
   }
+}
 
-  return 0;
+// Forget about FAT updates from any earlier session
+void fat32_mirror_begin(void)
+{
+  fat_mirror_first = 1;
+  fat_mirror_last = 0;
 }
 
-unsigned long find_contiguous_clusters(unsigned long total_clusters) {
-  unsigned long start_cluster = 0;
+// Bring FAT2 up to date with everything written to FAT1 this session
+void fat32_mirror_finish(void)
+{
+  if (fat_mirror_mode != FAT_MIRROR_DEFERRED)
+    return;
+  if (fat_mirror_first <= fat_mirror_last)
+    fat32_mirror_copy(fat_mirror_first, fat_mirror_last - fat_mirror_first + 1);
+  fat_mirror_first = 1;
+  fat_mirror_last = 0;
+  fat32_mark_clean();
+}
 
-  while (1) {
-    int is_contiguous = 1;
-    unsigned long cnt;
-    start_cluster = find_free_cluster(start_cluster);
+// Returns non-zero unless FAT1 says that the last session did not finish
+unsigned char fat32_mirror_is_clean(void)
+{
+  sector_cache_readsector(fat_partition_start + fat1_sector);
+  return (*((uint32_t *)&sector_buffer[4]) & FAT_CLEAN_SHUTDOWN) != 0;
+}
 
-    for (cnt = 1; cnt < total_clusters; cnt++) {
-      if (!is_free_cluster(start_cluster + cnt)) {
-        is_contiguous = 0;
-        break;
-      }
-    }
+/*
+  If FAT1 says that the last session did not finish, copy all of it to
+  FAT2, and redo FSInfo. Returns 1 if a repair was needed.
+*/
+unsigned char fat32_mirror_repair(void)
+{
+  if (fat32_mirror_is_clean())
+    return 0;
+  fat32_mirror_copy(0, fat_sectors);
+  fat32_mark_clean();
 
-    if (is_contiguous)
-      break;
+  // FSInfo is only written at the end of a session, so it is stale too
+#ifndef __CC65__
+  fat32_refresh_fsinfo();
+#else
+  fat32_fsinfo_begin(FSINFO_UNKNOWN, FSINFO_UNKNOWN);
+#endif
+  fat32_write_fsinfo();
+  return 1;
+}
 
-    start_cluster += cnt;
-  }
+// Write sector_buffer to a sector of FAT1, and to FAT2 unless mirroring is deferred
+void fat32_write_fat_sector(const uint32_t fat_sector_num)
+{
+  sector_cache_writesector(fat_partition_start + fat1_sector + fat_sector_num);
+  if (fat_mirror_mode == FAT_MIRROR_DEFERRED)
+    fat32_mirror_note(fat_sector_num, 1);
+  else
+    sector_cache_writesector(fat_partition_start + fat2_sector + fat_sector_num);
+}
 
-  return start_cluster;
+unsigned long fat32_follow_cluster(unsigned long cluster)
+{
+  // Read out the cluster number from the FAT
+  sector_cache_readsector(fat_partition_start + fat1_sector + (cluster / 128));
+  // (only the low 28 bits of a FAT32 entry are the cluster number)
+  return *((uint32_t *)&sector_buffer[(cluster & 127) << 2]) & 0x0fffffff;
 }
 
 /*
-  Create a file in the root directory of the new FAT32 filesystem
-  with the indicated name and size.
+  Allocate a free cluster, and link it onto the end of the chain that
+  currently ends at the given cluster (or start a new chain if cluster
+  is zero). Returns the new cluster, or 0 if the disk is full.
+*/
+unsigned long fat32_allocate_cluster(unsigned long cluster)
+{
+  unsigned long r;
+  unsigned short o;
+
+  r = find_contiguous_clusters(1);
+  if (!r)
+    return 0;
+  fat32_claim_clusters(r, 1);
+
+  // Mark the new cluster as end of chain
+  o = (r & 127) << 2;
+  sector_cache_readsector(fat_partition_start + fat1_sector + r / 128);
+  *((uint32_t *)&sector_buffer[o]) = 0x0FFFFFF8;
+  fat32_write_fat_sector(r / 128);
+
+  if (cluster) {
+    o = (cluster & 127) << 2;
+    sector_cache_readsector(fat_partition_start + fat1_sector + cluster / 128);
+    *((uint32_t *)&sector_buffer[o]) = r;
+    fat32_write_fat_sector(cluster / 128);
+  }
 
-  The file will be created contiguous on disk, and the first
-  sector of the created file returned.
+  return r;
+}
 
-  The root directory is the start of cluster 2, and clusters are
-  assumed to be 4KB in size, to keep things simple.
+#ifndef __CC65__
+int are_there_gaps_between_files(void)
+{
+  fat_scan_summary_t summary;
 
-  XXX -- Should allow creation of files in sub-directories
+  // A used entry anywhere after the first free one is a gap
+  fat32_scan_fat(0, (fat2_sector - fat1_sector) * 128, NULL, &summary);
+  return summary.first_free != FAT_SCAN_NONE && summary.last_used != FAT_SCAN_NONE
+      && summary.last_used > summary.first_free;
+}
 
+/*
+  Count the free clusters in FAT1 again, for when the tracked FSInfo
+  values can't be trusted.
 */
-long fat32_create_contiguous_file(char *name, long size, long root_dir_sector, long fat1_sector, long fat2_sector)
-{
-  unsigned char i = 0, sn = 0, len = 0;
-  unsigned short offset = 0, j = 0;
-  unsigned short clusters = 0;
-  unsigned long k, start_cluster = 0;
-  unsigned long start_offset;
-  int cluster_tally;
-  unsigned long dir_cluster = 2;
-  unsigned long last_dir_cluster = 2;
-  //  unsigned long next_cluster;
-  //  unsigned long contiguous_clusters = 0;
-  unsigned long fat_sector_num = 0;
-  unsigned long fat_sector_count = 0;
-
-  unsigned char have_dir_slot = 0;
-  unsigned long free_dir_sector_num = 0;
-  unsigned short free_dir_sector_ofs = 0;
-  struct m65_tm tm;
+void fat32_refresh_fsinfo(void)
+{
+  fat_scan_summary_t summary;
 
-  char message[40] = "Found file: ????????.???";
+  fat32_scan_fat(0, fs_clusters, NULL, &summary);
+  fsinfo_free_count = summary.free_count;
+  fsinfo_next_free = summary.first_free == FAT_SCAN_NONE ? FSINFO_UNKNOWN : summary.first_free;
+}
+#endif
+
+/*
+  Directory index: a hash of the 8.3 names in a directory, and a list of
+  the slots in it that can be reused, so that creating a file does not
+  mean reading through the whole directory again to check for a duplicate
+  name and to find a free slot. It is built with one pass over the
+  directory the first time it is needed, and then kept up to date as
+  entries are added.
+
+  On the MEGA65 there is only room for a small index. If a directory has
+  more names than that, duplicates are looked for by reading through the
+  directory again.
+*/
+#ifdef __CC65__
+#define DIR_INDEX_NAMES 64
+#define DIR_INDEX_BUCKETS 16
+#define DIR_INDEX_FREE_SLOTS 8
+typedef unsigned char dir_index_t;
+#define DIR_INDEX_NONE 0xff
+#else
+// A FAT directory can't have more entries than this anyway
+#define DIR_INDEX_NAMES 65536UL
+#define DIR_INDEX_BUCKETS 16384
+#define DIR_INDEX_FREE_SLOTS 1024
+typedef uint32_t dir_index_t;
+#define DIR_INDEX_NONE 0xffffffffUL
+#endif
+uint32_t dir_index_sector[DIR_INDEX_NAMES];
+uint8_t dir_index_entry[DIR_INDEX_NAMES];
+uint16_t dir_index_hash[DIR_INDEX_NAMES];
+dir_index_t dir_index_next[DIR_INDEX_NAMES];
+dir_index_t dir_index_bucket[DIR_INDEX_BUCKETS];
+dir_index_t dir_index_count = 0;
+unsigned char dir_index_overflow = 0;
+unsigned char dir_index_valid = 0;
+// The indexed directory
+uint32_t dir_index_root = 0;
+uint32_t dir_index_first_cluster = 0;
+// Deleted entries that can be reused
+uint32_t dir_free_sector[DIR_INDEX_FREE_SLOTS];
+uint8_t dir_free_entry[DIR_INDEX_FREE_SLOTS];
+unsigned short dir_free_count = 0;
+// The end of directory marker (if the directory chain isn't full)
+unsigned char dir_end_valid = 0;
+uint32_t dir_end_cluster;
+unsigned char dir_end_sn, dir_end_entry;
+uint32_t dir_last_cluster;
+
+void dir_index_invalidate(void)
+{
+  dir_index_valid = 0;
+}
 
-  clusters = size / (512 * sectors_per_cluster);
-  if (size % (512 * sectors_per_cluster))
-    clusters++;
+static uint16_t dir_index_hash_name(const char *name)
+{
+  uint16_t h = 0;
+  unsigned char i;
 
-  // Look for a free directory slot.
-  // Also complain if the file already exists
-  //  mega65_serial_monitor_write("Search for free directory slot\n");
+  for (i = 0; i < 11; i++)
+    h = ((h << 5) | (h >> 11)) ^ (unsigned char)name[i];
+  return h;
+}
 
-  while (dir_cluster >= 2 && dir_cluster < 0xf0000000) {
-    for (sn = 0; sn < sectors_per_cluster; sn++) {
+static uint32_t dir_sector(const uint32_t cluster, const unsigned char sn)
+{
+  return dir_index_root + (cluster - 2) * sectors_per_cluster + sn;
+}
 
-      sdcard_readsector(root_dir_sector + ((dir_cluster - 2) * sectors_per_cluster) + sn);
-
-      for (offset = 0; offset < 512; offset += 32) {
-        for (i = 0; i < 8; i++)
-          message[i] = sector_buffer[offset + i];
-        len = 8;
-        while (len && (message[len] == ' ' || message[len] == 0))
-          len--;
-        message[len++] = '.';
-        for (i = 0; i < 3; i++)
-          message[len + i] = sector_buffer[offset + 8 + i];
-        len += 3;
-        while (len && (message[len] == ' ' || message[len] == 0))
-          len--;
-        if (!strcmp(message, name)) {
-          // ERROR: Name already exists
-          //	  mega65_serial_monitor_write("File already exists\n");
-          return 0;
-        }
+static void dir_index_add_name(const char *name, const uint32_t sector, const unsigned char entry)
+{
+  dir_index_t n = dir_index_count;
+  uint16_t h;
+
+  if (n == DIR_INDEX_NAMES) {
+    dir_index_overflow = 1;
+    return;
+  }
+  dir_index_count++;
+  h = dir_index_hash_name(name);
+  dir_index_sector[n] = sector;
+  dir_index_entry[n] = entry;
+  dir_index_hash[n] = h;
+  dir_index_next[n] = dir_index_bucket[h & (DIR_INDEX_BUCKETS - 1)];
+  dir_index_bucket[h & (DIR_INDEX_BUCKETS - 1)] = n;
+}
+
+// Is sector_buffer entry e a file or directory (rather than free, a volume label or a long name part)?
+static unsigned char dir_entry_has_name(const unsigned char e)
+{
+  if (!sector_buffer[e * 32] || sector_buffer[e * 32] == 0xe5)
+    return 0;
+  return !(sector_buffer[e * 32 + 0x0b] & 0x08);
+}
 
-        // Is the slot free?
-        if (sector_buffer[offset] == 0) {
-          free_dir_sector_num = root_dir_sector + ((dir_cluster - 2) * sectors_per_cluster) + sn;
-          free_dir_sector_ofs = offset;
-          have_dir_slot = 1;
-          //	  mega65_serial_monitor_write("Found free directory slot:\n");
-          serial_hex(dir_cluster);
-          serial_hex(sn);
-          serial_hex(offset);
-
-          break;
+// Read through the directory, indexing the names and free slots in it
+static void dir_index_build(const uint32_t root_dir_sector, const uint32_t first_cluster)
+{
+  uint32_t cluster = first_cluster, sector;
+  unsigned short i;
+  unsigned char sn, e;
+
+  for (i = 0; i < DIR_INDEX_BUCKETS; i++)
+    dir_index_bucket[i] = DIR_INDEX_NONE;
+  dir_index_count = 0;
+  dir_index_overflow = 0;
+  dir_free_count = 0;
+  dir_end_valid = 0;
+  dir_index_root = root_dir_sector;
+  dir_index_first_cluster = first_cluster;
+  dir_index_valid = 1;
+
+  while (cluster >= 2 && cluster < 0x0ffffff8) {
+    dir_last_cluster = cluster;
+    for (sn = 0; sn < sectors_per_cluster; sn++) {
+      sector = dir_sector(cluster, sn);
+      sector_cache_readsector(sector);
+      for (e = 0; e < 16; e++) {
+        if (!sector_buffer[e * 32]) {
+          // Nothing follows the end of directory marker
+          dir_end_valid = 1;
+          dir_end_cluster = cluster;
+          dir_end_sn = sn;
+          dir_end_entry = e;
+          return;
+        }
+        if (sector_buffer[e * 32] == 0xe5) {
+          if (dir_free_count < DIR_INDEX_FREE_SLOTS) {
+            dir_free_sector[dir_free_count] = sector;
+            dir_free_entry[dir_free_count++] = e;
+          }
         }
+        else if (dir_entry_has_name(e))
+          dir_index_add_name((char *)&sector_buffer[e * 32], sector, e);
       }
-      if (have_dir_slot)
-        break;
     }
-    // Stop once we have found a free directory slot
-    if (have_dir_slot)
-      break;
-
-    // Chain to next directory cluster, and extend directory
-    // if required.
-    last_dir_cluster = dir_cluster;
-    dir_cluster = fat32_follow_cluster(dir_cluster);
-    if ((!dir_cluster) || (dir_cluster >= 0xf0000000)) {
-      // End of directory --
-      dir_cluster = fat32_allocate_cluster(last_dir_cluster);
+    cluster = fat32_follow_cluster(cluster);
+  }
+}
 
-      //      mega65_serial_monitor_write("Allocating new directory cluster");
-      serial_hex(dir_cluster);
+// Linear search of the directory, for when the index is incomplete
+static int dir_scan_for_name(const char *name)
+{
+  uint32_t cluster = dir_index_first_cluster;
+  unsigned char sn, e;
 
-      if ((!dir_cluster) || (dir_cluster >= 0xf0000000)) {
-        // Disk full
-        return 0;
+  while (cluster >= 2 && cluster < 0x0ffffff8) {
+    for (sn = 0; sn < sectors_per_cluster; sn++) {
+      sector_cache_readsector(dir_sector(cluster, sn));
+      for (e = 0; e < 16; e++) {
+        if (!sector_buffer[e * 32])
+          return -1;
+        if (dir_entry_has_name(e) && !memcmp(&sector_buffer[e * 32], name, 11))
+          return e * 32;
       }
-      else {
+    }
+    cluster = fat32_follow_cluster(cluster);
+  }
+  return -1;
+}
 
-        // Zero out new directory cluster
-        //	mega65_serial_monitor_write("Zeroing out new directory cluster\n");
-        serial_hex(dir_cluster);
-        lfill((unsigned long)sector_buffer, 0, 512);
-        for (sn = 0; sn < sectors_per_cluster; sn++) {
-          sdcard_readsector(root_dir_sector + ((dir_cluster - 2) * sectors_per_cluster) + sn);
-        }
-      }
+/*
+  Look for the entry with this (11 character, space padded) name. If there
+  is one, it is left in sector_buffer, and its offset there is returned.
+  Otherwise returns -1.
+*/
+static int dir_index_find(const char *name)
+{
+  uint16_t h = dir_index_hash_name(name);
+  dir_index_t n;
+
+  for (n = dir_index_bucket[h & (DIR_INDEX_BUCKETS - 1)]; n != DIR_INDEX_NONE; n = dir_index_next[n]) {
+    if (dir_index_hash[n] != h)
+      continue;
+    sector_cache_readsector(dir_index_sector[n]);
+    if (!memcmp(&sector_buffer[dir_index_entry[n] * 32], name, 11))
+      return dir_index_entry[n] * 32;
+  }
+  if (dir_index_overflow)
+    return dir_scan_for_name(name);
+  return -1;
+}
+
+// Make sure that the index is for the given directory
+static void dir_index_use(const uint32_t root_dir_sector, const uint32_t first_cluster)
+{
+  if (!dir_index_valid || dir_index_root != root_dir_sector || dir_index_first_cluster != first_cluster)
+    dir_index_build(root_dir_sector, first_cluster);
+}
+
+static void dir_zero_cluster(const uint32_t cluster)
+{
+  unsigned char sn;
+
+  lfill((unsigned long)sector_buffer, 0, 512);
+  for (sn = 0; sn < sectors_per_cluster; sn++)
+    sector_cache_writesector(dir_sector(cluster, sn));
+}
+
+/*
+  Pick the slot for a new directory entry: a deleted entry, or else the
+  end of the directory, which is extended by a cluster if it is full.
+  Returns 0 if the disk is full.
+*/
+static unsigned char dir_index_take_slot(uint32_t *sector, unsigned char *entry)
+{
+  uint32_t cluster;
+
+  if (dir_free_count) {
+    dir_free_count--;
+    *sector = dir_free_sector[dir_free_count];
+    *entry = dir_free_entry[dir_free_count];
+    return 1;
+  }
+
+  if (!dir_end_valid) {
+    cluster = fat32_allocate_cluster(dir_last_cluster);
+    if (!cluster || cluster >= 0x0ffffff8)
+      return 0;
+
+    // Zero out new directory cluster
+    dir_zero_cluster(cluster);
+    dir_last_cluster = cluster;
+    dir_end_valid = 1;
+    dir_end_cluster = cluster;
+    dir_end_sn = 0;
+    dir_end_entry = 0;
+  }
+
+  *sector = dir_sector(dir_end_cluster, dir_end_sn);
+  *entry = dir_end_entry;
+
+  // Move the end marker along
+  if (++dir_end_entry == 16) {
+    dir_end_entry = 0;
+    if (++dir_end_sn == sectors_per_cluster) {
+      dir_end_sn = 0;
+      cluster = fat32_follow_cluster(dir_end_cluster);
+      if (cluster >= 2 && cluster < 0x0ffffff8)
+        dir_last_cluster = dir_end_cluster = cluster;
+      else
+        dir_end_valid = 0;
     }
   }
+  return 1;
+}
 
-  start_cluster = find_contiguous_clusters(clusters);
-
-  //  mega65_serial_monitor_write("Found contiguous space beginning at cluster $");
-  serial_hex(start_cluster);
-
-  // Write cluster chain into both FATs
-  //  mega65_serial_monitor_write("Writing FAT sectors for file\r\n");
-  fat_sector_num = start_cluster / 128;
-  //  next_cluster=start_cluster+1;
-  fat_sector_count = clusters / 128;
-  if (clusters & 127)
-    fat_sector_count++;
-  start_offset = (start_cluster%128)*4;
-  cluster_tally = 0;
-  for (k = 0; k < fat_sector_count; k++) {
-    // Fill FAT sector with chain
-    for (offset = start_offset; offset < 512; offset += 4) {
-      if (cluster_tally < clusters) {
-        // Write chain
-        *(unsigned long *)&sector_buffer[offset] = (k << 7) + (offset >> 2) + 1;
-      }
-      if (cluster_tally == (clusters - 1)) {
+// Give back a slot that dir_index_take_slot() handed out, but which was not used after all
+static void dir_index_return_slot(const uint32_t sector, const unsigned char entry)
+{
+  if (dir_free_count == DIR_INDEX_FREE_SLOTS)
+    dir_free_count--;
+  dir_free_sector[dir_free_count] = sector;
+  dir_free_entry[dir_free_count++] = entry;
+}
+
+/*
+  Write the cluster chains of files that lie next to each other on the
+  disk into the FAT. Only the FAT sectors at either end of the run can
+  hold entries of other files, so only those are read first. The sectors
+  in between are generated outright, and each batch of FAT sectors goes
+  to FAT1 (and FAT2, unless its mirroring is deferred) as a single
+  multi-sector write.
+*/
+static void fat32_write_chains(const fat32_file_t *files, const unsigned short count)
+{
+  uint32_t cluster = files[0].start_cluster;
+  uint32_t last_cluster = files[count - 1].start_cluster + files[count - 1].clusters - 1;
+  uint32_t file_end = files[0].start_cluster + files[0].clusters - 1;
+  uint32_t fat_sector_num = cluster / 128, last_fat_sector = last_cluster / 128;
+  unsigned short batch, offset, f = 0;
+
+  // FAT1 must be marked as not clean before it gets ahead of FAT2
+  if (fat_mirror_mode == FAT_MIRROR_DEFERRED)
+    fat32_mirror_note(fat_sector_num, last_fat_sector - fat_sector_num + 1);
+  // The FAT code may still hold some of these sectors in the cache
+  sector_cache_sync_range(fat_partition_start + fat1_sector + fat_sector_num, last_fat_sector - fat_sector_num + 1);
+  sector_cache_sync_range(fat_partition_start + fat2_sector + fat_sector_num, last_fat_sector - fat_sector_num + 1);
+  while (fat_sector_num <= last_fat_sector) {
+    batch = last_fat_sector - fat_sector_num + 1 > MULTI_SECTOR_COUNT ? MULTI_SECTOR_COUNT
+                                                                       : last_fat_sector - fat_sector_num + 1;
+    // Keep the neighbouring entries in partially used sectors
+    if (cluster & 127)
+      sdcard_readsectors(fat_partition_start + fat1_sector + fat_sector_num, 1, multi_sector_buffer);
+    if (fat_sector_num + batch - 1 == last_fat_sector && (last_cluster & 127) != 127 && (batch > 1 || !(cluster & 127)))
+      sdcard_readsectors(fat_partition_start + fat1_sector + last_fat_sector, 1, &multi_sector_buffer[(batch - 1) * 512]);
+
+    for (; cluster <= last_cluster && cluster < (fat_sector_num + batch) * 128; cluster++) {
+      offset = (cluster - fat_sector_num * 128) << 2;
+      if (cluster == file_end) {
         // Mark end of chain
-        *(unsigned long *)&sector_buffer[offset] = 0x0FFFFFF8;
+        *(uint32_t *)&multi_sector_buffer[offset] = 0x0FFFFFF8;
+        if (++f < count)
+          file_end = files[f].start_cluster + files[f].clusters - 1;
       }
-      cluster_tally++;
+      else
+        *(uint32_t *)&multi_sector_buffer[offset] = cluster + 1;
     }
-    start_offset = 0;
-    // Write FAT sector to both FATs
-    sdcard_writesector(fat1_sector + fat_sector_num + k);
-    sdcard_writesector(fat2_sector + fat_sector_num + k);
+    sdcard_writesectors(fat_partition_start + fat1_sector + fat_sector_num, batch, multi_sector_buffer);
+    if (fat_mirror_mode != FAT_MIRROR_DEFERRED)
+      sdcard_writesectors(fat_partition_start + fat2_sector + fat_sector_num, batch, multi_sector_buffer);
+    fat_sector_num += batch;
   }
+}
+
+// Fill in directory entry e of sector_buffer
+static void fat32_build_dir_entry(const unsigned char e, const char *dos_name, const unsigned char attributes,
+    const uint32_t start_cluster, const long size, const unsigned short time, const unsigned short date)
+{
+  unsigned short ofs = e * 32;
+  unsigned char i;
 
-  // Build directory entry
-  //  mega65_serial_monitor_write("Building directory entry\r\n");
-  sdcard_readsector(free_dir_sector_num);
   // Clear entry
   for (i = 0; i < 32; i++)
-    sector_buffer[free_dir_sector_ofs + i] = 0x00;
+    sector_buffer[ofs + i] = 0x00;
   // Write name
-  // Fill name with space
   for (i = 0; i < 11; i++)
-    sector_buffer[free_dir_sector_ofs + i] = 0x20;
-  // Then overwrite with actual name
-  for (i = 0, j = 0; i < 11; i++, j++) {
+    sector_buffer[ofs + i] = dos_name[i];
+  sector_buffer[ofs + 0x0b] = attributes;
+
+  // Create time 0x0e -- 0x0f
+  *(unsigned short *)&sector_buffer[ofs + 0x0e] = time;
+  // Modify time 0x16 -- 0x17
+  //  *(unsigned short *)&sector_buffer[ofs + 0x16]=time;
+  // Create date 0x10 -- 0x11
+  *(unsigned short *)&sector_buffer[ofs + 0x10] = date;
+  // Modify date 0x18 -- 0x19
+  // *(unsigned short *)&sector_buffer[ofs + 0x18]=date;
+  // Start cluster
+  sector_buffer[ofs + 0x1A] = start_cluster;
+  sector_buffer[ofs + 0x1B] = start_cluster >> 8;
+  sector_buffer[ofs + 0x14] = start_cluster >> 16;
+  sector_buffer[ofs + 0x15] = start_cluster >> 24;
+  // File length
+  sector_buffer[ofs + 0x1C] = (size >> 0) & 0xff;
+  sector_buffer[ofs + 0x1D] = (size >> 8L) & 0xff;
+  sector_buffer[ofs + 0x1E] = (size >> 16L) & 0xff;
+  sector_buffer[ofs + 0x1F] = (size >> 24l) & 0xff;
+}
+
+/*
+  The name as it appears in a directory entry, from either "NAME.EXT" or
+  the space padded form. Stops at a '/', so works for each part of a path.
+*/
+static void fat32_dos_name(const char *name, char *dos_name)
+{
+  unsigned char i, j;
+
+  for (i = 0; i < 11; i++)
+    dos_name[i] = ' ';
+  for (i = 0, j = 0; i < 11 && name[j] && name[j] != '/'; i++, j++) {
     if (name[j] == '.')
       i = 7;
     else
-      sector_buffer[free_dir_sector_ofs + i] = name[j];
+      dos_name[i] = name[j];
+  }
+}
+
+// The file name part of a path
+static const char *fat32_leaf_name(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+
+  return slash ? slash + 1 : path;
+}
+
+// Is the name used by any of the first count files of the batch that are being created?
+static unsigned char fat32_batch_contains(const fat32_file_t *files, const unsigned short count, const char *dos_name)
+{
+  char other[11];
+  unsigned short n;
+
+  for (n = 0; n < count; n++) {
+    if (!files[n].first_sector)
+      continue;
+    fat32_dos_name(fat32_leaf_name(files[n].name), other);
+    if (!memcmp(other, dos_name, 11))
+      return 1;
   }
-  sector_buffer[free_dir_sector_ofs + 0x0b] = 0x20; // Archive bit set
+  return 0;
+}
+
+// The time and date for directory entries, from the RTC
+static void fat32_timestamp(unsigned short *time, unsigned short *date)
+{
+  struct m65_tm tm;
 
   //  mega65_serial_monitor_write("Getting RTC timestamp\r\n");
   getrtc(&tm);
-  //  mega65_serial_monitor_write("Got RTC timestamp\r\n");
+  *time = (tm.tm_hour << 11);
+  *time |= (tm.tm_min << 5);
+  *time |= (tm.tm_sec >> 1);
+  *date = ((tm.tm_year - 80) << 9); // DOS is based on 1980, tm struct on 1900
+  *date |= (tm.tm_mon << 5);
+  *date |= tm.tm_mday;
+}
 
-  j = (tm.tm_hour << 11);
-  j |= (tm.tm_min << 5);
-  j |= (tm.tm_sec >> 1);
-  // Create time 0x0e -- 0x0f
-  *(unsigned short *)&sector_buffer[free_dir_sector_ofs + 0x0e] = j;
-  // Modify time 0x16 -- 0x17
-  //  *(unsigned short *)&sector_buffer[free_dir_sector_ofs + 0x16]=j;
-  j = ((tm.tm_year - 80) << 9); // DOS is based on 1980, tm struct on 1900
-  j |= (tm.tm_mon << 5);
-  j |= tm.tm_mday;
-  // Create date 0x10 -- 0x11
-  *(unsigned short *)&sector_buffer[free_dir_sector_ofs + 0x10] = j;
-  // Modify date 0x18 -- 0x19
-  // *(unsigned short *)&sector_buffer[free_dir_sector_ofs + 0x18]=j;
-  // Start cluster
-  sector_buffer[free_dir_sector_ofs + 0x1A] = start_cluster;
-  sector_buffer[free_dir_sector_ofs + 0x1B] = start_cluster >> 8;
-  sector_buffer[free_dir_sector_ofs + 0x14] = start_cluster >> 16;
-  sector_buffer[free_dir_sector_ofs + 0x15] = start_cluster >> 24;
-  // File length
-  sector_buffer[free_dir_sector_ofs + 0x1C] = (size >> 0) & 0xff;
-  sector_buffer[free_dir_sector_ofs + 0x1D] = (size >> 8L) & 0xff;
-  sector_buffer[free_dir_sector_ofs + 0x1E] = (size >> 16L) & 0xff;
-  sector_buffer[free_dir_sector_ofs + 0x1F] = (size >> 24l) & 0xff;
-
-  sdcard_writesector(free_dir_sector_num);
-  //  mega65_serial_monitor_write("Wrote DIR sector $");
-  serial_hex(free_dir_sector_num);
-  //  mega65_serial_monitor_write("@ offset $");
-  serial_hex(free_dir_sector_ofs);
-
-  return root_dir_sector + (start_cluster - 2) * 8;
+/*
+  Make a new directory with the given (space padded) name in the directory
+  that starts at parent. Returns its first cluster, or 0 if there is no
+  room for it.
+*/
+static uint32_t fat32_make_directory(const long root_dir_sector, const uint32_t parent, const char *dos_name,
+    const unsigned short time, const unsigned short date)
+{
+  uint32_t sector, cluster;
+  unsigned char entry;
+
+  dir_index_use(root_dir_sector, parent);
+  if (!dir_index_take_slot(&sector, &entry))
+    return 0;
+  cluster = fat32_allocate_cluster(0);
+  if (!cluster) {
+    dir_index_return_slot(sector, entry);
+    return 0;
+  }
+
+  // The new directory holds just "." and ".." (which is cluster 0 for the root directory)
+  dir_zero_cluster(cluster);
+  fat32_build_dir_entry(0, ".          ", 0x10, cluster, 0, time, date);
+  fat32_build_dir_entry(1, "..         ", 0x10, parent == root_dir_cluster ? 0 : parent, 0, time, date);
+  sector_cache_writesector(dir_sector(cluster, 0));
+
+  sector_cache_readsector(sector);
+  fat32_build_dir_entry(entry, dos_name, 0x10, cluster, 0, time, date);
+  sector_cache_writesector(sector);
+  dir_index_add_name(dos_name, sector, entry);
+  return cluster;
+}
+
+/*
+  Find the directory named by a path like "GAMES/RPG", making any parts
+  of it that don't exist yet. If whole is zero, the last part of the path
+  is a file name, and is skipped. Returns the first cluster of the
+  directory, or 0 if it can't be made (or a file is in the way).
+*/
+static uint32_t fat32_path_directory(const long root_dir_sector, const char *path, const unsigned char whole,
+    const unsigned short time, const unsigned short date)
+{
+  uint32_t dir = root_dir_cluster;
+  const char *end;
+  char dos_name[11];
+  int ofs;
+
+  while (*path) {
+    end = strchr(path, '/');
+    if (!end) {
+      if (!whole)
+        break;
+      end = path + strlen(path);
+    }
+    fat32_dos_name(path, dos_name);
+    dir_index_use(root_dir_sector, dir);
+    ofs = dir_index_find(dos_name);
+    if (ofs < 0)
+      dir = fat32_make_directory(root_dir_sector, dir, dos_name, time, date);
+    else if (sector_buffer[ofs + 0x0b] & 0x10)
+      dir = sector_buffer[ofs + 0x1a] | ((uint16_t)sector_buffer[ofs + 0x1b] << 8)
+          | ((uint32_t)sector_buffer[ofs + 0x14] << 16) | ((uint32_t)sector_buffer[ofs + 0x15] << 24);
+    else
+      dir = 0;
+    if (!dir)
+      return 0;
+    if (!*end)
+      break;
+    path = end + 1;
+  }
+  return dir;
+}
+
+// Make a directory (and any missing parents), e.g. "GAMES/RPG". Returns its first cluster, or 0.
+uint32_t fat32_create_directory(char *path, long root_dir_sector)
+{
+  unsigned short time, date;
+
+  fat32_timestamp(&time, &date);
+  return fat32_path_directory(root_dir_sector, path, 1, time, date);
+}
+
+/*
+  Create files that all go in the directory that starts at dir_cluster.
+  All of the directory slots and clusters are planned first. Then the
+  cluster chains of files that are next to each other are written to the
+  FAT together, and each directory sector is written once with all of its
+  new entries.
+*/
+static unsigned short fat32_create_files_in(const long root_dir_sector, const uint32_t dir_cluster, fat32_file_t *files,
+    const unsigned short count, const unsigned short time, const unsigned short date)
+{
+  unsigned short n, first, created = 0;
+  uint32_t dir_sector_num = 0;
+  char dos_name[11];
+
+  dir_index_use(root_dir_sector, dir_cluster);
+
+  // Plan: a directory slot and a run of clusters for each file
+  for (n = 0; n < count; n++) {
+    fat32_dos_name(fat32_leaf_name(files[n].name), dos_name);
+    if (dir_index_find(dos_name) >= 0 || fat32_batch_contains(files, n, dos_name))
+      // ERROR: Name already exists
+      continue;
+    if (!dir_index_take_slot(&files[n].dir_sector, &files[n].dir_entry))
+      // Disk full
+      continue;
+
+    // Empty files don't get any clusters at all
+    if (files[n].clusters) {
+      files[n].start_cluster = find_contiguous_clusters(files[n].clusters);
+      if (!files[n].start_cluster) {
+        // Disk full
+        dir_index_return_slot(files[n].dir_sector, files[n].dir_entry);
+        continue;
+      }
+      fat32_claim_clusters(files[n].start_cluster, files[n].clusters);
+      files[n].first_sector = root_dir_sector + (files[n].start_cluster - 2) * sectors_per_cluster;
+    }
+    else
+      // Nothing to write, but still a success
+      files[n].first_sector = root_dir_sector;
+    created++;
+  }
+
+  // Write the cluster chains into the FAT, a run of adjacent files at a time
+  //  mega65_serial_monitor_write("Writing FAT sectors for files\r\n");
+  for (n = 0; n < count; n = first) {
+    first = n + 1;
+    if (!files[n].start_cluster)
+      continue;
+    while (first < count && files[first].start_cluster
+           && files[first].start_cluster == files[first - 1].start_cluster + files[first - 1].clusters)
+      first++;
+    fat32_write_chains(&files[n], first - n);
+  }
+
+  // Build directory entries, writing each directory sector once
+  //  mega65_serial_monitor_write("Building directory entries\r\n");
+  for (n = 0; n < count; n++) {
+    if (!files[n].first_sector)
+      continue;
+    if (files[n].dir_sector != dir_sector_num) {
+      if (dir_sector_num)
+        sector_cache_writesector(dir_sector_num);
+      dir_sector_num = files[n].dir_sector;
+      sector_cache_readsector(dir_sector_num);
+    }
+    fat32_dos_name(fat32_leaf_name(files[n].name), dos_name);
+    fat32_build_dir_entry(files[n].dir_entry, dos_name, 0x20, files[n].start_cluster, files[n].size, time, date);
+    dir_index_add_name(dos_name, files[n].dir_sector, files[n].dir_entry);
+  }
+  if (dir_sector_num)
+    sector_cache_writesector(dir_sector_num);
+
+  return created;
+}
+
+/*
+  Create a batch of files in the new FAT32 filesystem, with the names and
+  sizes given in the manifest. A name can include a path, such as
+  "GAMES/FOO.D81", in which case any missing directories are made too.
+
+  Each file is created contiguous on disk, and the first sector of each
+  file is filled in (or 0, if the file could not be created). Returns the
+  number of files created.
+
+  Files are handled in runs that go in the same directory, so that the FAT
+  and directory sectors they share are written once per run. The RTC is
+  read just once for the whole batch.
+
+  The root directory is the start of cluster 2.
+*/
+unsigned short fat32_create_contiguous_files(fat32_file_t *files, const unsigned short count, long root_dir_sector)
+{
+  unsigned short n, first, created = 0;
+  unsigned short time, date;
+  uint32_t dir_cluster;
+  unsigned char dir_length;
+
+  if (!count)
+    return 0;
+  fat32_timestamp(&time, &date);
+
+  for (n = 0; n < count; n++) {
+    files[n].first_sector = 0;
+    files[n].start_cluster = 0;
+    files[n].clusters = files[n].size / (512UL * sectors_per_cluster);
+    if (files[n].size % (512UL * sectors_per_cluster))
+      files[n].clusters++;
+  }
+
+  for (n = 0; n < count; n = first) {
+    // The run of files that go in the same directory as this one
+    dir_length = fat32_leaf_name(files[n].name) - files[n].name;
+    for (first = n + 1; first < count; first++)
+      if (fat32_leaf_name(files[first].name) - files[first].name != dir_length
+          || memcmp(files[first].name, files[n].name, dir_length))
+        break;
+
+    dir_cluster = fat32_path_directory(root_dir_sector, files[n].name, 0, time, date);
+    if (dir_cluster)
+      created += fat32_create_files_in(root_dir_sector, dir_cluster, &files[n], first - n, time, date);
+  }
+
+  return created;
+}
+
+// Create a single file, as above. Returns its first sector, or 0 on failure.
+long fat32_create_contiguous_file(char *name, long size, long root_dir_sector)
+{
+  fat32_file_t file;
+
+  strncpy(file.name, name, sizeof(file.name) - 1);
+  file.name[sizeof(file.name) - 1] = 0;
+  file.size = size;
+  fat32_create_contiguous_files(&file, 1, root_dir_sector);
+  return file.first_sector;
 }
@@ -1 +1,41 @@
-long fat32_create_contiguous_file(char *name, long size, long root_dir_sector, long fat1_sector, long fat2_sector);
+// Longest path that can be given for a file, e.g. "GAMES/FOO.D81"
+#define FAT32_PATH_LENGTH 32
+
+// A file for fat32_create_contiguous_files() to create
+typedef struct fat32_file {
+  char name[FAT32_PATH_LENGTH + 1]; // "NAME.EXT" or the 11 character space padded form, after any directories
+  long size;
+  // Filled in when the file is created
+  long first_sector;
+  uint32_t start_cluster;
+  uint32_t clusters;
+  uint32_t dir_sector;
+  unsigned char dir_entry;
+} fat32_file_t;
+
+unsigned short fat32_create_contiguous_files(fat32_file_t *files, const unsigned short count, long root_dir_sector);
+long fat32_create_contiguous_file(char *name, long size, long root_dir_sector);
+uint32_t fat32_create_directory(char *path, long root_dir_sector);
+void free_bitmap_invalidate(void);
+void dir_index_invalidate(void);
+// FSInfo value for a free count or next free cluster that isn't known
+#define FSINFO_UNKNOWN 0xffffffffUL
+void fat32_fsinfo_begin(const uint32_t free_count, const uint32_t next_free);
+void fat32_write_fsinfo(void);
+#ifndef __CC65__
+int are_there_gaps_between_files(void);
+void fat32_refresh_fsinfo(void);
+#endif
+
+// How FAT2 is kept up to date, see fdisk_fat32.c
+#define FAT_MIRROR_IMMEDIATE 0
+#define FAT_MIRROR_DEFERRED 1
+#ifndef FAT_MIRROR_DEFAULT
+#define FAT_MIRROR_DEFAULT FAT_MIRROR_DEFERRED
+#endif
+extern uint8_t fat_mirror_mode;
+void fat32_mirror_begin(void);
+void fat32_mirror_finish(void);
+unsigned char fat32_mirror_is_clean(void);
+unsigned char fat32_mirror_repair(void);
+void fat32_write_fat_sector(const uint32_t fat_sector_num);
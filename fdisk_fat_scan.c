@@ -0,0 +1,357 @@
+/*
+  Scanning buffers of FAT32 entries for free (zero) and used (non-zero)
+  entries. Entries are passed as the raw little-endian bytes read from the
+  card, and counts and results are in entries. A search that finds nothing
+  returns count.
+
+  On the host these run over whole words, or 16/32 bytes at a time with
+  SSE2/AVX2 where the CPU has them, so that scanning the FAT of a big card
+  runs at memory speed. The MEGA65 gets the simple loop.
+
+  The host also has fat_scan_parallel(), which splits a big buffer of FAT
+  entries between a pool of threads. Each summarises its chunk (free
+  count, first and last free entries, longest free run, and the free runs
+  at either end), and the chunk summaries are then combined in order.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __CC65__
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "fdisk_hal.h"
+#include "fdisk_fat_scan.h"
+
+#if !defined(__CC65__) && defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define FAT_SCAN_X86
+#include <immintrin.h>
+#endif
+
+#ifdef __CC65__
+static uint32_t fat_scan_simple(const uint8_t *entries, const uint32_t count, const unsigned char want_zero)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; i++, entries += 4)
+    if (((entries[0] | entries[1] | entries[2] | entries[3]) == 0) == want_zero)
+      return i;
+  return count;
+}
+
+uint32_t fat_scan_first_zero(const uint8_t *entries, const uint32_t count)
+{
+  return fat_scan_simple(entries, count, 1);
+}
+
+uint32_t fat_scan_first_nonzero(const uint8_t *entries, const uint32_t count)
+{
+  return fat_scan_simple(entries, count, 0);
+}
+#else
+// Two entries at a time in a 64-bit word
+static uint32_t fat_scan_words(const uint8_t *entries, uint32_t i, const uint32_t count, const int want_zero)
+{
+  uint64_t w;
+  uint32_t lo, hi;
+
+  for (; i + 2 <= count; i += 2) {
+    memcpy(&w, entries + i * 4, 8);
+    if (!want_zero && !w)
+      continue;
+    memcpy(&lo, entries + i * 4, 4);
+    memcpy(&hi, entries + i * 4 + 4, 4);
+    if ((lo == 0) == want_zero)
+      return i;
+    if ((hi == 0) == want_zero)
+      return i + 1;
+  }
+  if (i < count) {
+    memcpy(&lo, entries + i * 4, 4);
+    if ((lo == 0) == want_zero)
+      return i;
+  }
+  return count;
+}
+
+#ifdef FAT_SCAN_X86
+// Four entries at a time. The mask has a bit set for each zero entry.
+static uint32_t fat_scan_sse2(const uint8_t *entries, const uint32_t count, const int want_zero)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const int none = want_zero ? 0x0 : 0xf;
+  uint32_t i;
+  int mask;
+
+  for (i = 0; i + 4 <= count; i += 4) {
+    mask = _mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(entries + i * 4)), zero)));
+    if (mask != none)
+      return i + __builtin_ctz(want_zero ? mask : ~mask);
+  }
+  return fat_scan_words(entries, i, count, want_zero);
+}
+
+// Eight entries at a time, with two vectors in flight
+__attribute__((target("avx2"))) static uint32_t fat_scan_avx2(
+    const uint8_t *entries, const uint32_t count, const int want_zero)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const int none = want_zero ? 0x00 : 0xff;
+  uint32_t i;
+  int m0, m1;
+
+  for (i = 0; i + 16 <= count; i += 16) {
+    m0 = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(entries + i * 4)), zero)));
+    m1 = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(entries + i * 4 + 32)), zero)));
+    if (m0 != none)
+      return i + __builtin_ctz(want_zero ? m0 : ~m0);
+    if (m1 != none)
+      return i + 8 + __builtin_ctz(want_zero ? m1 : ~m1);
+  }
+  return i + fat_scan_sse2(entries + i * 4, count - i, want_zero);
+}
+#endif
+
+static uint32_t fat_scan(const uint8_t *entries, const uint32_t count, const int want_zero)
+{
+#ifdef FAT_SCAN_X86
+  static int have_avx2 = -1;
+
+  if (have_avx2 < 0) {
+    __builtin_cpu_init();
+    have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  if (have_avx2)
+    return fat_scan_avx2(entries, count, want_zero);
+  return fat_scan_sse2(entries, count, want_zero);
+#else
+  return fat_scan_words(entries, 0, count, want_zero);
+#endif
+}
+
+uint32_t fat_scan_first_zero(const uint8_t *entries, const uint32_t count)
+{
+  return fat_scan(entries, count, 1);
+}
+
+uint32_t fat_scan_first_nonzero(const uint8_t *entries, const uint32_t count)
+{
+  return fat_scan(entries, count, 0);
+}
+#endif
+
+// Length of the run of free entries beginning at entry start
+uint32_t fat_scan_zero_run(const uint8_t *entries, const uint32_t start, const uint32_t count)
+{
+  return fat_scan_first_nonzero(entries + start * 4, count - start);
+}
+
+#ifndef __CC65__
+// Mark entries [from, to) as used in the bitmap
+static void fat_scan_set_bits(uint8_t *bitmap, uint32_t from, const uint32_t to)
+{
+  for (; from < to && (from & 7); from++)
+    bitmap[from >> 3] |= 1 << (from & 7);
+  if (to - from >= 8) {
+    memset(bitmap + (from >> 3), 0xff, (to - from) >> 3);
+    from += (to - from) & ~7U;
+  }
+  for (; from < to; from++)
+    bitmap[from >> 3] |= 1 << (from & 7);
+}
+
+/*
+  Summarise count entries, the first of which is for first_cluster. If
+  bitmap is not NULL, also set a bit there for each used entry (the first
+  entry is bit 0 of bitmap[0]).
+*/
+void fat_scan_summarise(
+    const uint8_t *entries, const uint32_t first_cluster, const uint32_t count, uint8_t *bitmap, fat_scan_summary_t *s)
+{
+  uint32_t i = 0, run;
+
+  s->first_cluster = first_cluster;
+  s->entries = count;
+  s->free_count = 0;
+  s->first_free = s->last_free = s->last_used = FAT_SCAN_NONE;
+  s->leading_free = s->trailing_free = 0;
+  s->longest_free = 0;
+  s->longest_start = FAT_SCAN_NONE;
+  if (bitmap)
+    memset(bitmap, 0, (count + 7) / 8);
+
+  while (i < count) {
+    run = fat_scan_zero_run(entries, i, count);
+    if (run) {
+      if (!i)
+        s->leading_free = run;
+      if (s->first_free == FAT_SCAN_NONE)
+        s->first_free = first_cluster + i;
+      s->last_free = first_cluster + i + run - 1;
+      s->free_count += run;
+      if (run > s->longest_free) {
+        s->longest_free = run;
+        s->longest_start = first_cluster + i;
+      }
+      i += run;
+      if (i == count) {
+        s->trailing_free = run;
+        break;
+      }
+    }
+    run = fat_scan_first_zero(entries + i * 4, count - i);
+    if (bitmap)
+      fat_scan_set_bits(bitmap, i, i + run);
+    i += run;
+    s->last_used = first_cluster + i - 1;
+  }
+}
+
+// Fold the summary of the entries straight after a's into a
+void fat_scan_combine(fat_scan_summary_t *a, const fat_scan_summary_t *b)
+{
+  uint32_t joined = a->trailing_free + b->leading_free;
+
+  if (joined > a->longest_free && joined >= b->longest_free) {
+    a->longest_free = joined;
+    a->longest_start = a->first_cluster + a->entries - a->trailing_free;
+  }
+  else if (b->longest_free > a->longest_free) {
+    a->longest_free = b->longest_free;
+    a->longest_start = b->longest_start;
+  }
+  if (a->leading_free == a->entries)
+    a->leading_free += b->leading_free;
+  if (b->trailing_free == b->entries)
+    a->trailing_free += b->trailing_free;
+  else
+    a->trailing_free = b->trailing_free;
+  if (a->first_free == FAT_SCAN_NONE)
+    a->first_free = b->first_free;
+  if (b->last_free != FAT_SCAN_NONE)
+    a->last_free = b->last_free;
+  if (b->last_used != FAT_SCAN_NONE)
+    a->last_used = b->last_used;
+  a->free_count += b->free_count;
+  a->entries += b->entries;
+}
+
+#define FAT_SCAN_MAX_THREADS 16
+// Chunks smaller than this are not worth handing to another thread.
+// A multiple of 8, so that chunks start on a bitmap byte.
+#define FAT_SCAN_MIN_CHUNK (256 * 1024UL)
+
+typedef struct {
+  const uint8_t *entries;
+  uint32_t first_cluster;
+  uint32_t count;
+  uint8_t *bitmap;
+  fat_scan_summary_t summary;
+} fat_scan_job_t;
+
+static pthread_mutex_t fat_scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fat_scan_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fat_scan_done = PTHREAD_COND_INITIALIZER;
+static fat_scan_job_t fat_scan_jobs[FAT_SCAN_MAX_THREADS];
+static int fat_scan_threads = 0;
+static int fat_scan_job_count = 0;
+static int fat_scan_next_job = 0;
+static int fat_scan_jobs_left = 0;
+
+static void fat_scan_run_job(const int job)
+{
+  fat_scan_job_t *j = &fat_scan_jobs[job];
+
+  fat_scan_summarise(j->entries, j->first_cluster, j->count, j->bitmap, &j->summary);
+}
+
+static void *fat_scan_worker(void *unused)
+{
+  int job;
+
+  pthread_mutex_lock(&fat_scan_lock);
+  while (1) {
+    while (fat_scan_next_job >= fat_scan_job_count)
+      pthread_cond_wait(&fat_scan_work, &fat_scan_lock);
+    job = fat_scan_next_job++;
+    pthread_mutex_unlock(&fat_scan_lock);
+
+    fat_scan_run_job(job);
+
+    pthread_mutex_lock(&fat_scan_lock);
+    if (!--fat_scan_jobs_left)
+      pthread_cond_signal(&fat_scan_done);
+  }
+  return NULL;
+}
+
+// Start the pool on first use: one thread per CPU, counting the caller
+static void fat_scan_start_threads(void)
+{
+  pthread_t thread;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (cpus < 1)
+    cpus = 1;
+  if (cpus > FAT_SCAN_MAX_THREADS)
+    cpus = FAT_SCAN_MAX_THREADS;
+  for (fat_scan_threads = 1; fat_scan_threads < cpus; fat_scan_threads++) {
+    if (pthread_create(&thread, NULL, fat_scan_worker, NULL))
+      break;
+    pthread_detach(thread);
+  }
+}
+
+// As fat_scan_summarise(), but with the work shared between threads
+void fat_scan_parallel(
+    const uint8_t *entries, const uint32_t first_cluster, const uint32_t count, uint8_t *bitmap, fat_scan_summary_t *s)
+{
+  uint32_t chunk, offset = 0;
+  int jobs, job;
+
+  if (!fat_scan_threads)
+    fat_scan_start_threads();
+  jobs = count / FAT_SCAN_MIN_CHUNK;
+  if (jobs > fat_scan_threads)
+    jobs = fat_scan_threads;
+  if (jobs < 2) {
+    fat_scan_summarise(entries, first_cluster, count, bitmap, s);
+    return;
+  }
+
+  chunk = (count / jobs) & ~7U;
+  for (job = 0; job < jobs; job++) {
+    fat_scan_jobs[job].entries = entries + offset * 4;
+    fat_scan_jobs[job].first_cluster = first_cluster + offset;
+    fat_scan_jobs[job].count = job == jobs - 1 ? count - offset : chunk;
+    fat_scan_jobs[job].bitmap = bitmap ? bitmap + offset / 8 : NULL;
+    offset += chunk;
+  }
+
+  // Hand out the jobs, and do our share of them too
+  pthread_mutex_lock(&fat_scan_lock);
+  fat_scan_next_job = 0;
+  fat_scan_job_count = jobs;
+  fat_scan_jobs_left = jobs;
+  pthread_cond_broadcast(&fat_scan_work);
+  while (fat_scan_next_job < fat_scan_job_count) {
+    job = fat_scan_next_job++;
+    pthread_mutex_unlock(&fat_scan_lock);
+    fat_scan_run_job(job);
+    pthread_mutex_lock(&fat_scan_lock);
+    fat_scan_jobs_left--;
+  }
+  while (fat_scan_jobs_left)
+    pthread_cond_wait(&fat_scan_done, &fat_scan_lock);
+  pthread_mutex_unlock(&fat_scan_lock);
+
+  *s = fat_scan_jobs[0].summary;
+  for (job = 1; job < jobs; job++)
+    fat_scan_combine(s, &fat_scan_jobs[job].summary);
+}
+#endif
@@ -0,0 +1,27 @@
+uint32_t fat_scan_first_zero(const uint8_t *entries, const uint32_t count);
+uint32_t fat_scan_first_nonzero(const uint8_t *entries, const uint32_t count);
+uint32_t fat_scan_zero_run(const uint8_t *entries, const uint32_t start, const uint32_t count);
+
+#ifndef __CC65__
+#define FAT_SCAN_NONE 0xffffffffU
+
+// What a scan of (part of) the FAT found. Clusters are absolute, or FAT_SCAN_NONE.
+typedef struct fat_scan_summary {
+  uint32_t first_cluster;
+  uint32_t entries;
+  uint32_t free_count;
+  uint32_t first_free;
+  uint32_t last_free;
+  uint32_t last_used;
+  uint32_t leading_free;
+  uint32_t trailing_free;
+  uint32_t longest_free;
+  uint32_t longest_start;
+} fat_scan_summary_t;
+
+void fat_scan_summarise(
+    const uint8_t *entries, const uint32_t first_cluster, const uint32_t count, uint8_t *bitmap, fat_scan_summary_t *s);
+void fat_scan_combine(fat_scan_summary_t *a, const fat_scan_summary_t *b);
+void fat_scan_parallel(
+    const uint8_t *entries, const uint32_t first_cluster, const uint32_t count, uint8_t *bitmap, fat_scan_summary_t *s);
+#endif
@@ -0,0 +1,192 @@
+/*
+  Working out the layout of a card: where the FAT32 and MEGA65 system
+  partitions go, and how big the FATs and the data region of the FAT32
+  file system are.
+
+  Everything is worked out directly, rather than by shrinking a guess
+  until it fits, and without any intermediate that can overflow 32 bits,
+  so it is right for every card size up to 2TB. None of it touches the
+  card, so it can be checked for any size of card without having one.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fdisk_hal.h"
+#include "fdisk_geometry.h"
+
+/*
+  Pick the cluster size for a FAT32 partition of the given size. Bigger
+  clusters on bigger cards keep the FAT small, which makes formatting,
+  allocation and mounting faster. Smaller clusters are used if there would
+  otherwise be too few clusters for the partition to be FAT32.
+*/
+uint8_t choose_sectors_per_cluster(const uint32_t partition_sectors)
+{
+  uint8_t spc;
+
+  if (partition_sectors <= 8UL * 1024 * 2048) // 8GB
+    spc = 8;
+  else if (partition_sectors <= 16UL * 1024 * 2048)
+    spc = 16;
+  else if (partition_sectors <= 32UL * 1024 * 2048)
+    spc = 32;
+  else if (partition_sectors <= 96UL * 1024 * 2048)
+    spc = 64;
+  else
+    spc = 128;
+
+  // FAT32 needs at least 65525 clusters
+  while (spc > 1 && partition_sectors / spc < FAT32_MIN_CLUSTERS + 2 * 8)
+    spc >>= 1;
+  return spc;
+}
+
+// Sectors for a FAT with this many entries, padded so that the two FATs fill whole allocation units
+uint32_t fdisk_geometry_fat_sectors(const uint32_t clusters, const uint32_t align_sectors)
+{
+  uint32_t sectors = clusters / (512 / 4);
+  uint32_t unit = align_sectors / 2;
+
+  if (clusters % (512 / 4))
+    sectors++;
+  if (unit > 1 && sectors % unit)
+    sectors += unit - sectors % unit;
+  return sectors;
+}
+
+/*
+  How many 512KB freeze slots (and as many system service slots) fit in a
+  system partition of this size, after its 1MB of reserved space. See
+  build_mega65_sys_sector().
+*/
+uint32_t fdisk_geometry_slots(const uint32_t sys_partition_sectors)
+{
+  uint32_t slot_size = 512UL * 1024UL / 512UL;
+  uint32_t reserved = 1024UL * 1024UL / 512UL;
+  uint32_t slot_count;
+
+  if (sys_partition_sectors <= reserved)
+    return 0;
+  slot_count = (sys_partition_sectors - reserved) / (slot_size * 2 + 1);
+  // Limit number of freeze slots to 16 bit counters
+  if (slot_count >= 0xffff)
+    slot_count = 0xffff;
+  return slot_count;
+}
+
+/*
+  Fill in the FAT size and cluster count for avail sectors after the
+  reserved ones. A FAT of F sectors has room for 128F clusters, and leaves
+  room for (avail - 2F) / spc + 2 of them in the data region. The first
+  grows with F and the second shrinks, so the most clusters are had with
+  the FAT size where they cross, (avail + 2spc) / (128spc + 2), rounded to
+  an allocation unit. Returns 0 if there is no room at all.
+*/
+static unsigned char geometry_fit(fdisk_geometry_t *g, const uint32_t avail)
+{
+  uint32_t unit = g->align_sectors / 2, fat_hi, clusters, limit;
+  uint8_t spc = g->sectors_per_cluster;
+
+  fat_hi = avail / (128UL * spc + 2) + 1;
+  if (avail % (128UL * spc + 2) + 2UL * spc > 128UL * spc + 2)
+    fat_hi++;
+  if (fat_hi % unit)
+    fat_hi += unit - fat_hi % unit;
+  if (2 * fat_hi > avail)
+    return 0;
+  clusters = (avail - 2 * fat_hi) / spc + 2;
+
+  // Use the smallest FAT for that many clusters, and any room that frees up.
+  // This also covers the rounding down: if a FAT one allocation unit
+  // smaller would do, so that the FAT is full, that is what is used.
+  g->fat_sectors = fdisk_geometry_fat_sectors(clusters, g->align_sectors);
+  limit = (avail - 2 * g->fat_sectors) / spc + 2;
+  clusters = limit < 128 * g->fat_sectors ? limit : 128 * g->fat_sectors;
+  if (clusters > FAT32_MAX_CLUSTERS + 2) {
+    clusters = FAT32_MAX_CLUSTERS + 2;
+    g->fat_sectors = fdisk_geometry_fat_sectors(clusters, g->align_sectors);
+  }
+  g->fs_clusters = clusters;
+  g->data_sectors = (clusters - 2) * spc;
+  return 1;
+}
+
+/*
+  Lay out a card of card_sectors sectors, with the FAT32 file system using
+  clusters of sectors_per_cluster sectors (or 0 to choose from the size of
+  the partition), aligned to allocation units of align_sectors sectors
+  (a power of 2, of at least 8).
+
+  The FAT32 partition comes first, at 1MB or the first allocation unit,
+  and the MEGA65 system partition takes the end of the card. It gets half
+  of the card, up to 2GB, or more if the FAT32 partition would otherwise
+  be bigger than its largest allowed number of clusters needs.
+
+  Returns 1 if the FAT32 file system has a valid number of clusters, or 0
+  if the card is too small for that (the layout is filled in as far as it
+  goes).
+*/
+unsigned char fdisk_geometry_solve(
+    const uint32_t card_sectors, const uint8_t sectors_per_cluster, const uint32_t align_sectors, fdisk_geometry_t *g)
+{
+  uint32_t align = align_sectors, avail;
+
+  memset(g, 0, sizeof(fdisk_geometry_t));
+  g->card_sectors = card_sectors;
+
+  // Small cards have small allocation units
+  while (align > 8 && align > card_sectors / 128)
+    align >>= 1;
+  g->align_sectors = align;
+
+  g->fat_partition_start = align > 0x800 ? align : 0x800;
+  if (card_sectors <= g->fat_partition_start * 2)
+    return 0;
+  // The system partition should be sized to be not more than 50% of
+  // the SD card, and probably doesn't need to be bigger than 2GB, which would
+  // allow 1GB for 1,024 1MB freeze images and 1,024 1MB service images.
+  // (note that freeze images might end up being a funny size to allow for all
+  // mem plus a D81 image to be saved. This is all to be determined.)
+  // Simple solution for now: Use 1/2 disk for system partition, or 2GiB, whichever
+  // is smaller.
+  g->sys_partition_sectors = (card_sectors - g->fat_partition_start) >> 1;
+  if (g->sys_partition_sectors > 2 * 1024UL * (1024UL * 1024UL / 512UL))
+    g->sys_partition_sectors = 2 * 1024UL * (1024UL * 1024UL / 512UL);
+  // round down to nearest 1MB (or allocation unit) boundary
+  g->sys_partition_sectors &= ~(g->fat_partition_start - 1);
+  g->fat_partition_sectors = card_sectors - g->fat_partition_start - g->sys_partition_sectors;
+  g->sys_partition_start = g->fat_partition_start + g->fat_partition_sectors;
+  g->slot_count = fdisk_geometry_slots(g->sys_partition_sectors);
+
+  g->sectors_per_cluster
+      = sectors_per_cluster ? sectors_per_cluster : choose_sectors_per_cluster(g->fat_partition_sectors);
+
+  // Enough reserved sectors for the boot and FS information sectors (and
+  // their backups), ending on an allocation unit boundary. The FATs are
+  // padded to whole allocation units, so the first cluster is aligned too.
+  g->reserved_sectors = align < 32 ? 32 : align;
+  if (g->fat_partition_sectors <= g->reserved_sectors + align)
+    return 0;
+  avail = g->fat_partition_sectors - g->reserved_sectors;
+
+  if (!geometry_fit(g, avail))
+    return 0;
+  // If the choice of cluster size left too few clusters (because of the
+  // reserved sectors and the padding of the FATs), use smaller ones
+  while (!sectors_per_cluster && g->sectors_per_cluster > 1 && g->fs_clusters - 2 < FAT32_MIN_CLUSTERS) {
+    g->sectors_per_cluster >>= 1;
+    geometry_fit(g, avail);
+  }
+
+  // If FAT32 can't have that many clusters, the FAT32 partition ends after
+  // the last one, and the system partition gets the rest of the card
+  if (g->fs_clusters - 2 == FAT32_MAX_CLUSTERS) {
+    g->fat_partition_sectors = g->reserved_sectors + 2 * g->fat_sectors + g->data_sectors;
+    g->sys_partition_start = g->fat_partition_start + g->fat_partition_sectors;
+    g->sys_partition_sectors = card_sectors - g->sys_partition_start;
+    g->slot_count = fdisk_geometry_slots(g->sys_partition_sectors);
+  }
+
+  return g->fs_clusters - 2 >= FAT32_MIN_CLUSTERS;
+}
@@ -0,0 +1,25 @@
+// Where everything goes on a card, as worked out by fdisk_geometry_solve(). All in sectors.
+typedef struct fdisk_geometry {
+  uint32_t card_sectors;
+  uint32_t align_sectors; // allocation unit used, after scaling down for small cards
+  uint32_t fat_partition_start;
+  uint32_t fat_partition_sectors;
+  uint32_t sys_partition_start;
+  uint32_t sys_partition_sectors;
+  uint32_t reserved_sectors; // before the first FAT
+  uint32_t fat_sectors;      // each FAT
+  uint32_t fs_clusters;      // including the two reserved FAT entries, so clusters 2 to fs_clusters-1 are usable
+  uint32_t data_sectors;     // (fs_clusters - 2) * sectors_per_cluster
+  uint32_t slot_count;       // freeze slots (and as many service slots) in the system partition
+  uint8_t sectors_per_cluster;
+} fdisk_geometry_t;
+
+// Smallest and largest number of clusters (not counting the two reserved FAT entries) for FAT32
+#define FAT32_MIN_CLUSTERS 65525UL
+#define FAT32_MAX_CLUSTERS 0x0FFFFFF5UL
+
+uint8_t choose_sectors_per_cluster(const uint32_t partition_sectors);
+uint32_t fdisk_geometry_fat_sectors(const uint32_t clusters, const uint32_t align_sectors);
+uint32_t fdisk_geometry_slots(const uint32_t sys_partition_sectors);
+unsigned char fdisk_geometry_solve(
+    const uint32_t card_sectors, const uint8_t sectors_per_cluster, const uint32_t align_sectors, fdisk_geometry_t *g);
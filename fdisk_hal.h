@@ -3,15 +3,77 @@
 #include <stdint.h>
 
 extern uint8_t sector_buffer[512];
+
+// Staging area for multi-sector transfers. Kept small on the MEGA65, where
+// it has to fit below the screen with everything else.
+#ifdef __CC65__
+#define MULTI_SECTOR_COUNT 4
+#else
+#define MULTI_SECTOR_COUNT 128
+#endif
+extern uint8_t multi_sector_buffer[MULTI_SECTOR_COUNT * 512];
 extern unsigned char sdhc_card;
+#ifndef __CC65__
+// The card's preferred write size, if the OS tells us
+extern uint32_t sdcard_physical_block_size;
+#endif
+
+// Read-before-write policy for sdcard_writesector(), see fdisk_hal_common.c
+#define SDCARD_COMPARE_ALWAYS 0
+#define SDCARD_COMPARE_NEVER 1
+#define SDCARD_COMPARE_ERASED 2
+#ifndef SDCARD_COMPARE_DEFAULT
+#ifdef __CC65__
+#define SDCARD_COMPARE_DEFAULT SDCARD_COMPARE_ERASED
+#else
+#define SDCARD_COMPARE_DEFAULT SDCARD_COMPARE_NEVER
+#endif
+#endif
+extern uint8_t sdcard_compare_policy;
+extern uint32_t sdcard_compare_hits;
+extern uint32_t sdcard_compare_misses;
+
+// Verification of written sectors, see fdisk_hal_common.c
+#define SDCARD_VERIFY_NONE 0
+#define SDCARD_VERIFY_SAMPLED 1
+#define SDCARD_VERIFY_DEFERRED 2
+#define SDCARD_VERIFY_FULL 3
+#ifndef SDCARD_VERIFY_DEFAULT
+#ifdef __CC65__
+#define SDCARD_VERIFY_DEFAULT SDCARD_VERIFY_FULL
+#else
+#define SDCARD_VERIFY_DEFAULT SDCARD_VERIFY_NONE
+#endif
+#endif
+extern uint8_t sdcard_verify_mode;
+extern uint16_t sdcard_verify_interval;
+extern uint32_t sdcard_verify_errors;
+// The deferred verify pass reads back this many sectors at a time
+#ifdef __CC65__
+#define VERIFY_SECTOR_COUNT 1
+#else
+#define VERIFY_SECTOR_COUNT 64
+#endif
+extern uint8_t verify_buffer[VERIFY_SECTOR_COUNT * 512];
+
+// Results of sdcard_write_action()
+#define SDCARD_WRITE 0
+#define SDCARD_COMPARE 1
+#define SDCARD_SKIP 2
 
 unsigned char get_random_byte(void);
 uint32_t sdcard_getsize(void);
 void sdcard_open(void);
 void sdcard_writesector(const uint32_t sector_number);
 void sdcard_readsector(const uint32_t sector_number);
+void sdcard_readsectors(const uint32_t first_sector, const uint16_t count, uint8_t *buffer);
+void sdcard_writesectors(const uint32_t first_sector, const uint16_t count, const uint8_t *buffer);
+void sdcard_writesectors_from(const uint32_t first_sector, const uint16_t count, const long source_address);
 void flash_read512bytes(const uint32_t byte_offset);
+void flash_read(const uint32_t byte_offset, const uint32_t length, long destination_address);
 void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector);
+void sdcard_flush(void);
+void sdcard_report_stats(void);
 void mega65_fast(void);
 void sdcard_map_sector_buffer(void);
 void multisector_write_test(void);
@@ -19,3 +81,13 @@ void sdcard_readspeed_test(void);
 void sdcard_select(unsigned char n);
 unsigned char mega65_getkey(void);
 unsigned char sdcard_reset(void);
+void sdcard_session_reset(void);
+void sdcard_note_erased(const uint32_t first_sector, const uint32_t last_sector);
+void sdcard_note_written(const uint32_t first_sector, const uint32_t count);
+unsigned char sdcard_write_action(const uint32_t sector_number);
+unsigned char sdcard_compare_result(const unsigned char matched);
+unsigned char sdcard_verify_wanted(const uint32_t sector_number, const uint8_t *buffer);
+void sdcard_verify_error(const uint32_t first_sector, const uint32_t count);
+void sdcard_verify_sector(const uint32_t sector_number, const uint8_t *buffer);
+void sdcard_verify_writes(const uint32_t first_sector, const uint16_t count, const uint8_t *buffer);
+uint32_t sdcard_verify_deferred(void);
@@ -0,0 +1,322 @@
+/*
+  HAL bookkeeping that is the same for the MEGA65 and unix builds.
+
+  sdcard_writesector() can read a sector back before writing it, and skip
+  the write if the card already holds that data. This saves real device
+  writes when re-formatting a card, but is wasted effort on a blank one.
+  sdcard_compare_policy chooses between:
+
+    SDCARD_COMPARE_ALWAYS - always read and compare first
+    SDCARD_COMPARE_NEVER  - always just write
+    SDCARD_COMPARE_ERASED - compare, except in ranges that sdcard_erase()
+                            has just blanked. Their contents are known, so a
+                            sector of zeroes needs no write at all, and
+                            anything else is written without reading.
+
+  Hits count writes that were saved, misses count compare reads that did
+  not save anything.
+
+  Writes that do happen are then verified according to sdcard_verify_mode:
+
+    SDCARD_VERIFY_NONE     - trust the card
+    SDCARD_VERIFY_SAMPLED  - read back every sdcard_verify_interval'th sector
+    SDCARD_VERIFY_DEFERRED - only keep a checksum of each range written, and
+                             read them all back in one pass at the end
+                             (sdcard_verify_deferred())
+    SDCARD_VERIFY_FULL     - read back every sector straight after writing
+*/
+
+#include <stdio.h>
+
+#include "fdisk_hal.h"
+#ifdef __CC65__
+#include "fdisk_screen.h"
+#endif
+
+#define SDCARD_ERASED_RANGES 8
+
+uint8_t sdcard_compare_policy = SDCARD_COMPARE_DEFAULT;
+uint32_t sdcard_compare_hits = 0;
+uint32_t sdcard_compare_misses = 0;
+
+uint32_t sdcard_erased_first[SDCARD_ERASED_RANGES];
+uint32_t sdcard_erased_last[SDCARD_ERASED_RANGES];
+uint8_t sdcard_erased_count = 0;
+uint8_t sdcard_erased_replace = 0;
+
+uint8_t sdcard_verify_mode = SDCARD_VERIFY_DEFAULT;
+uint16_t sdcard_verify_interval = 16;
+uint16_t sdcard_verify_countdown = 0;
+uint32_t sdcard_verify_errors = 0;
+uint8_t verify_buffer[VERIFY_SECTOR_COUNT * 512];
+
+// Written ranges waiting for the deferred verify pass
+#ifdef __CC65__
+#define SDCARD_DEFERRED_RANGES 32
+#else
+#define SDCARD_DEFERRED_RANGES 1024
+#endif
+uint32_t sdcard_deferred_first[SDCARD_DEFERRED_RANGES];
+uint16_t sdcard_deferred_count[SDCARD_DEFERRED_RANGES];
+uint16_t sdcard_deferred_sum[SDCARD_DEFERRED_RANGES];
+uint16_t sdcard_deferred_ranges = 0;
+
+static void sdcard_deferred_forget(const uint32_t first_sector, const uint32_t count);
+static void sdcard_deferred_settle(const uint32_t first_sector, const uint32_t count);
+
+void sdcard_session_reset(void)
+{
+  sdcard_deferred_ranges = 0;
+  sdcard_verify_countdown = 0;
+  sdcard_verify_errors = 0;
+  sdcard_erased_count = 0;
+  sdcard_erased_replace = 0;
+  sdcard_compare_hits = 0;
+  sdcard_compare_misses = 0;
+}
+
+void sdcard_note_erased(const uint32_t first_sector, const uint32_t last_sector)
+{
+  unsigned char i;
+
+  if (last_sector < first_sector)
+    return;
+  if (sdcard_erased_count < SDCARD_ERASED_RANGES)
+    i = sdcard_erased_count++;
+  else {
+    // Forgetting a range is always safe, it just costs compares
+    i = sdcard_erased_replace;
+    sdcard_erased_replace = (sdcard_erased_replace + 1) % SDCARD_ERASED_RANGES;
+  }
+  sdcard_erased_first[i] = first_sector;
+  sdcard_erased_last[i] = last_sector;
+
+  // Whatever was written there before is gone now
+  sdcard_deferred_forget(first_sector, last_sector - first_sector + 1);
+}
+
+/*
+  Called by the HAL just before it writes sectors. They are no longer known
+  to be blank, and any deferred verify that covers them has to be done now,
+  while the old contents are still there to be checked.
+*/
+void sdcard_note_written(const uint32_t first_sector, const uint32_t count)
+{
+  unsigned char i, n;
+  uint32_t last_sector = first_sector + count - 1;
+
+  if (!count)
+    return;
+  if (sdcard_deferred_ranges)
+    sdcard_deferred_settle(first_sector, count);
+  n = sdcard_erased_count;
+  for (i = 0; i < n; i++) {
+    if (last_sector < sdcard_erased_first[i] || first_sector > sdcard_erased_last[i])
+      continue;
+    if (last_sector < sdcard_erased_last[i]) {
+      if (first_sector > sdcard_erased_first[i]) {
+        // Written in the middle, so keep the part after it as well
+        sdcard_note_erased(last_sector + 1, sdcard_erased_last[i]);
+        sdcard_erased_last[i] = first_sector - 1;
+      }
+      else
+        sdcard_erased_first[i] = last_sector + 1;
+    }
+    else if (first_sector > sdcard_erased_first[i])
+      sdcard_erased_last[i] = first_sector - 1;
+    else {
+      // Completely overwritten: leave an empty range behind
+      sdcard_erased_first[i] = 1;
+      sdcard_erased_last[i] = 0;
+    }
+  }
+}
+
+static unsigned char sdcard_is_erased(const uint32_t sector_number)
+{
+  unsigned char i;
+
+  for (i = 0; i < sdcard_erased_count; i++)
+    if (sector_number >= sdcard_erased_first[i] && sector_number <= sdcard_erased_last[i])
+      return 1;
+  return 0;
+}
+
+// What sdcard_writesector() should do with the contents of sector_buffer
+unsigned char sdcard_write_action(const uint32_t sector_number)
+{
+  unsigned short i;
+
+  switch (sdcard_compare_policy) {
+  case SDCARD_COMPARE_NEVER:
+    return SDCARD_WRITE;
+  case SDCARD_COMPARE_ERASED:
+    if (!sdcard_is_erased(sector_number))
+      break;
+    for (i = 0; i < 512; i++)
+      if (sector_buffer[i])
+        return SDCARD_WRITE;
+    sdcard_compare_hits++;
+    return SDCARD_SKIP;
+  }
+  return SDCARD_COMPARE;
+}
+
+// Record the outcome of a compare, and return non-zero if the write can be skipped
+unsigned char sdcard_compare_result(const unsigned char matched)
+{
+  if (matched)
+    sdcard_compare_hits++;
+  else
+    sdcard_compare_misses++;
+  return matched;
+}
+
+void sdcard_verify_error(const uint32_t first_sector, const uint32_t count)
+{
+  sdcard_verify_errors++;
+#ifdef __CC65__
+  write_line("Verify error for sector $$$$$$$$", 0);
+  screen_hex(screen_line_address - 80 + 24, first_sector);
+#else
+  fprintf(stderr, "ERROR: Verify failed for sectors $%08x..$%08x\n", (unsigned int)first_sector,
+      (unsigned int)(first_sector + count - 1));
+#endif
+}
+
+// Fletcher-style checksum, carried on from one sector to the next
+static uint16_t sdcard_checksum(const uint16_t sum, const uint8_t *buffer)
+{
+  uint8_t a = sum, b = sum >> 8;
+  unsigned short i;
+
+  for (i = 0; i < 512; i++) {
+    a += buffer[i];
+    b += a;
+  }
+  return a | (b << 8);
+}
+
+void sdcard_verify_sector(const uint32_t sector_number, const uint8_t *buffer)
+{
+  unsigned short i;
+
+  sdcard_readsectors(sector_number, 1, verify_buffer);
+  for (i = 0; i < 512; i++)
+    if (buffer[i] != verify_buffer[i]) {
+      sdcard_verify_error(sector_number, 1);
+      return;
+    }
+}
+
+static void sdcard_deferred_check(const uint16_t range)
+{
+  uint16_t n, i, batch, sum = 0;
+
+  for (n = 0; n < sdcard_deferred_count[range]; n += batch) {
+    batch = sdcard_deferred_count[range] - n;
+    if (batch > VERIFY_SECTOR_COUNT)
+      batch = VERIFY_SECTOR_COUNT;
+    sdcard_readsectors(sdcard_deferred_first[range] + n, batch, verify_buffer);
+    for (i = 0; i < batch; i++)
+      sum = sdcard_checksum(sum, verify_buffer + i * 512);
+  }
+  if (sum != sdcard_deferred_sum[range])
+    sdcard_verify_error(sdcard_deferred_first[range], sdcard_deferred_count[range]);
+}
+
+// Drop pending ranges that overlap the given sectors
+static void sdcard_deferred_forget(const uint32_t first_sector, const uint32_t count)
+{
+  uint16_t i = 0;
+
+  while (i < sdcard_deferred_ranges) {
+    if (sdcard_deferred_first[i] >= first_sector + count
+        || sdcard_deferred_first[i] + sdcard_deferred_count[i] <= first_sector) {
+      i++;
+      continue;
+    }
+    sdcard_deferred_ranges--;
+    sdcard_deferred_first[i] = sdcard_deferred_first[sdcard_deferred_ranges];
+    sdcard_deferred_count[i] = sdcard_deferred_count[sdcard_deferred_ranges];
+    sdcard_deferred_sum[i] = sdcard_deferred_sum[sdcard_deferred_ranges];
+  }
+}
+
+// Check and drop pending ranges that are about to be overwritten. This is
+// mostly FAT and directory sectors, so cheap.
+static void sdcard_deferred_settle(const uint32_t first_sector, const uint32_t count)
+{
+  uint16_t i;
+
+  for (i = 0; i < sdcard_deferred_ranges; i++)
+    if (sdcard_deferred_first[i] < first_sector + count
+        && sdcard_deferred_first[i] + sdcard_deferred_count[i] > first_sector)
+      sdcard_deferred_check(i);
+  sdcard_deferred_forget(first_sector, count);
+}
+
+static void sdcard_deferred_record(const uint32_t sector_number, const uint8_t *buffer)
+{
+  uint16_t i, last = sdcard_deferred_ranges - 1;
+
+  // Extend the most recent range if this sector follows on from it
+  if (sdcard_deferred_ranges && sdcard_deferred_first[last] + sdcard_deferred_count[last] == sector_number
+      && sdcard_deferred_count[last] < 0xffff) {
+    sdcard_deferred_count[last]++;
+    sdcard_deferred_sum[last] = sdcard_checksum(sdcard_deferred_sum[last], buffer);
+    return;
+  }
+
+  if (sdcard_deferred_ranges == SDCARD_DEFERRED_RANGES)
+    sdcard_verify_deferred();
+  i = sdcard_deferred_ranges++;
+  sdcard_deferred_first[i] = sector_number;
+  sdcard_deferred_count[i] = 1;
+  sdcard_deferred_sum[i] = sdcard_checksum(0, buffer);
+}
+
+/*
+  Called by the HAL once a sector has been written. Returns non-zero if
+  it should be read back and compared straight away.
+*/
+unsigned char sdcard_verify_wanted(const uint32_t sector_number, const uint8_t *buffer)
+{
+  switch (sdcard_verify_mode) {
+  case SDCARD_VERIFY_FULL:
+    return 1;
+  case SDCARD_VERIFY_SAMPLED:
+    if (sdcard_verify_countdown) {
+      sdcard_verify_countdown--;
+      return 0;
+    }
+    sdcard_verify_countdown = sdcard_verify_interval - 1;
+    return 1;
+  case SDCARD_VERIFY_DEFERRED:
+    sdcard_deferred_record(sector_number, buffer);
+  }
+  return 0;
+}
+
+// Verify a range of freshly written sectors, as the mode asks
+void sdcard_verify_writes(const uint32_t first_sector, const uint16_t count, const uint8_t *buffer)
+{
+  uint16_t n;
+
+  if (sdcard_verify_mode == SDCARD_VERIFY_NONE)
+    return;
+  for (n = 0; n < count; n++)
+    if (sdcard_verify_wanted(first_sector + n, buffer + n * 512L))
+      sdcard_verify_sector(first_sector + n, buffer + n * 512L);
+}
+
+// Read back everything written since the last pass. Returns the total number of verify errors.
+uint32_t sdcard_verify_deferred(void)
+{
+  uint16_t i;
+
+  for (i = 0; i < sdcard_deferred_ranges; i++)
+    sdcard_deferred_check(i);
+  sdcard_deferred_ranges = 0;
+  return sdcard_verify_errors;
+}
@@ -178,9 +178,25 @@ uint32_t sdcard_getsize(void)
 
 void sdcard_open(void)
 {
+  sdcard_session_reset();
   sdcard_reset();
 }
 
+void sdcard_flush(void)
+{
+  // Every write has completed (and been verified) by the time it returns
+}
+
+// Say how the read-before-write policy did
+void sdcard_report_stats(void)
+{
+  if (sdcard_compare_policy == SDCARD_COMPARE_NEVER)
+    return;
+  write_line("Read-before-write:       writes saved,       compares wasted", 0);
+  screen_decimal(screen_line_address - 80 + 19, sdcard_compare_hits > 65535U ? 65535U : sdcard_compare_hits);
+  screen_decimal(screen_line_address - 80 + 39, sdcard_compare_misses > 65535U ? 65535U : sdcard_compare_misses);
+}
+
 uint32_t write_count = 0;
 
 void sdcard_map_sector_buffer(void)
@@ -199,7 +215,7 @@ void sdcard_unmap_sector_buffer(void)
 
 unsigned short timeout;
 
-void do_read_sector(unsigned char cmd, uint32_t sector_number)
+void do_read_sector(unsigned char cmd, uint32_t sector_number, long destination_address)
 {
   char tries = 0;
   uint32_t sector_address = sector_number;
@@ -253,7 +269,7 @@ void do_read_sector(unsigned char cmd, uint32_t sector_number)
 
     if (!(PEEK(sd_ctl) & 0x67)) {
       // Copy data from hardware sector buffer via DMA
-      lcopy(sd_sectorbuffer, (long)sector_buffer, 512);
+      lcopy(sd_sectorbuffer, destination_address, 512);
 
       return;
     }
@@ -261,7 +277,7 @@ void do_read_sector(unsigned char cmd, uint32_t sector_number)
     POKE(0xd020, (PEEK(0xd020) + 1) & 0xf);
 
     // Reset SD card
-    sdcard_open();
+    sdcard_reset();
 
     tries++;
   }
@@ -270,15 +286,67 @@ void do_read_sector(unsigned char cmd, uint32_t sector_number)
 void sdcard_readsector(const uint32_t sector_number)
 {
 
-  do_read_sector(0x02, sector_number);
+  do_read_sector(0x02, sector_number, (long)sector_buffer);
+}
+
+void sdcard_readsectors(const uint32_t first_sector, const uint16_t count, uint8_t *buffer)
+{
+  // There is no multi-block read command, but we can at least DMA each
+  // sector straight to where it is wanted.
+  uint16_t n;
+
+  for (n = 0; n < count; n++)
+    do_read_sector(0x02, first_sector + n, (long)buffer + n * 512L);
 }
 
 void flash_read512bytes(const uint32_t byte_offset)
 {
-  do_read_sector(0x53, byte_offset);
+  do_read_sector(0x53, byte_offset, (long)sector_buffer);
 }
 
-uint8_t verify_buffer[512];
+/*
+  Read a run of bytes from flash straight to anywhere in memory. The flash
+  address is only set up once, and then moved along a page at a time,
+  touching just the address bytes that change. A page that fails is retried
+  the slow way.
+*/
+void flash_read(const uint32_t byte_offset, const uint32_t length, long destination_address)
+{
+  uint32_t address = byte_offset;
+  uint32_t remaining = length;
+  unsigned short chunk;
+
+  POKE(sd_addr + 0, (address >> 0) & 0xff);
+  POKE(sd_addr + 2, (address >> 16) & 0xff);
+  POKE(sd_addr + 3, (address >> 24) & 0xff);
+
+  while (remaining) {
+    chunk = remaining > 512 ? 512 : remaining;
+    POKE(sd_addr + 1, (address >> 8) & 0xff);
+
+    while (PEEK(sd_ctl) & 3)
+      continue;
+    POKE(sd_ctl, 0x53);
+    while (PEEK(sd_ctl) & 3)
+      continue;
+
+    if (!(PEEK(sd_ctl) & 0x67))
+      lcopy(sd_sectorbuffer, destination_address, chunk);
+    else {
+      do_read_sector(0x53, address, (long)sector_buffer);
+      lcopy((long)sector_buffer, destination_address, chunk);
+    }
+
+    destination_address += chunk;
+    remaining -= chunk;
+    address += 512;
+    if (!(address & 0xfe00)) {
+      // Crossed a 64KB boundary
+      POKE(sd_addr + 2, (address >> 16) & 0xff);
+      POKE(sd_addr + 3, (address >> 24) & 0xff);
+    }
+  }
+}
 
 void sdcard_writesector(const uint32_t sector_number)
 {
@@ -286,6 +354,7 @@ void sdcard_writesector(const uint32_t sector_number)
   uint32_t sector_address;
   int i;
   char tries = 0, result;
+  unsigned char verify;
   uint16_t counter = 0;
 
   while (PEEK(sd_ctl) & 3) {
@@ -300,26 +369,32 @@ void sdcard_writesector(const uint32_t sector_number)
   POKE(sd_addr + 2, (sector_address >> 16) & 0xff);
   POKE(sd_addr + 3, (sector_address >> 24) & 0xff);
 
-  // Read the sector and see if it already has the correct contents.
-  // If so, nothing to write
+  switch (sdcard_write_action(sector_number)) {
+  case SDCARD_SKIP:
+    return;
+  case SDCARD_COMPARE:
+    // Read the sector and see if it already has the correct contents.
+    // If so, nothing to write
 
-  POKE(sd_ctl, 2); // read the sector we just wrote
+    POKE(sd_ctl, 2); // read the sector we just wrote
 
-  while (PEEK(sd_ctl) & 3) {
-    continue;
-  }
+    while (PEEK(sd_ctl) & 3) {
+      continue;
+    }
 
-  // Copy the read data to a buffer for verification
-  lcopy(sd_sectorbuffer, (long)verify_buffer, 512);
+    // Copy the read data to a buffer for verification
+    lcopy(sd_sectorbuffer, (long)verify_buffer, 512);
 
-  // Verify that it matches the data we wrote
-  for (i = 0; i < 512; i++) {
-    if (sector_buffer[i] != verify_buffer[i])
-      break;
-  }
-  if (i == 512) {
-    return;
+    // Verify that it matches the data we wrote
+    for (i = 0; i < 512; i++) {
+      if (sector_buffer[i] != verify_buffer[i])
+        break;
+    }
+    if (sdcard_compare_result(i == 512)) {
+      return;
+    }
   }
+  sdcard_note_written(sector_number, 1);
 
   while (tries < 10) {
 
@@ -387,6 +462,10 @@ void sdcard_writesector(const uint32_t sector_number)
 
       POKE(0xD020, write_count & 0x0f);
 
+      // The sector is always read back (see below), but only compared if
+      // the verify mode wants it now
+      verify = sdcard_verify_wanted(sector_number, sector_buffer);
+
       // There is a bug in the SD controller: You have to read between writes, or it
       // gets really upset.
 
@@ -408,6 +487,9 @@ void sdcard_writesector(const uint32_t sector_number)
         continue;
       }
 
+      if (!verify)
+        return;
+
       // Copy the read data to a buffer for verification
       lcopy(sd_sectorbuffer, (long)verify_buffer, 512);
 
@@ -418,8 +500,7 @@ void sdcard_writesector(const uint32_t sector_number)
       }
       if (i != 512) {
         // VErify error has occurred
-        write_line("Verify error for sector $$$$$$$$", 0);
-        screen_hex(screen_line_address - 80 + 24, sector_number);
+        sdcard_verify_error(sector_number, 1);
       }
       else {
         //      write_line("Wrote sector $$$$$$$$, result=$$",2);
@@ -437,6 +518,78 @@ void sdcard_writesector(const uint32_t sector_number)
   screen_hex(screen_line_address - 80 + 2 + 16, sector_number);
 }
 
+void sdcard_writesectors(const uint32_t first_sector, const uint16_t count, const uint8_t *buffer)
+{
+  sdcard_writesectors_from(first_sector, count, (long)buffer);
+}
+
+// Multi-block write from anywhere in memory, e.g., a staging area in upper RAM
+void sdcard_writesectors_from(const uint32_t first_sector, const uint16_t count, const long source_address)
+{
+  uint16_t n;
+
+  // A multi-block write has to be started and ended, so a single sector
+  // goes through the normal (verified) path
+  if (count == 1) {
+    lcopy(source_address, (long)sector_buffer, 512);
+    sdcard_writesector(first_sector);
+    return;
+  }
+
+  sdcard_note_written(first_sector, count);
+
+  POKE(sd_addr + 0, (first_sector >> 0) & 0xff);
+  POKE(sd_addr + 1, (first_sector >> 8) & 0xff);
+  POKE(sd_addr + 2, (first_sector >> 16) & 0xff);
+  POKE(sd_addr + 3, (first_sector >> 24) & 0xff);
+
+  for (n = 0; n < count; n++) {
+    // Wait for SD card to go ready
+    while (PEEK(sd_ctl) & 3)
+      continue;
+
+    // Only touch the hardware buffer once the previous block has gone
+    lcopy(source_address + n * 512L, sd_sectorbuffer, 512);
+
+    if (first_sector + n)
+      POKE(sd_ctl, 0x57); // open SD card write gate
+    else
+      POKE(sd_ctl, 0x4D); // open SD card write gate for MBR
+    if (!n) {
+      // First sector of multi-sector write
+      POKE(sd_ctl, 0x04);
+    }
+    else if (n == count - 1) {
+      // Last sector of multi-sector write
+      POKE(sd_ctl, 0x06);
+    }
+    else
+      // All other sectors
+      POKE(sd_ctl, 0x05);
+
+    // Wait for SD card to go busy
+    while (!(PEEK(sd_ctl) & 3))
+      continue;
+
+    // Wait for SD card to go ready
+    while (PEEK(sd_ctl) & 3)
+      continue;
+
+    write_count++;
+    POKE(0xD020, write_count & 0x0f);
+  }
+
+  // The data may not be in low memory, so verify it a sector at a time
+  // from sector_buffer
+  if (sdcard_verify_mode == SDCARD_VERIFY_NONE)
+    return;
+  for (n = 0; n < count; n++) {
+    lcopy(source_address + n * 512L, (long)sector_buffer, 512);
+    if (sdcard_verify_wanted(first_sector + n, sector_buffer))
+      sdcard_verify_sector(first_sector + n, sector_buffer);
+  }
+}
+
 void sdcard_readspeed_test(void)
 {
   uint32_t n;
@@ -711,4 +864,6 @@ void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector)
     screen_decimal(screen_line_address + 1, last_sector - n);
     //    fprintf(stderr,"."); fflush(stderr);
   }
+
+  sdcard_note_erased(first_sector, last_sector);
 }
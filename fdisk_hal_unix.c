@@ -1,14 +1,833 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for fallocate()
+#endif
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <strings.h>
 #include <termios.h>
 #include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 
 #include "fdisk_hal.h"
 
-FILE *sdcard = NULL;
-FILE *flash = NULL;
+int sdcard_fd = -1;
+const char *sdcard_name = NULL;
+uint64_t sdcard_bytes = 0;
+uint32_t sdcard_logical_block_size = 512;
+uint32_t sdcard_physical_block_size = 512;
+int flash_fd = -1;
+uint8_t *flash_map = NULL;
+uint64_t flash_bytes = 0;
+static int first_flash_read = 1;
+
+/*
+  The SD card (or image file) can be driven through different backends,
+  selected with the SDCARDBACKEND environment variable. Each backend only
+  has to move runs of whole sectors; sizing, erasing and the rest of the
+  HAL are shared. A backend that cannot be used for the given SDCARDFILE
+  fails its open() and we fall back to plain pread()/pwrite().
+
+  erase() zeroes a range without the data passing through write(), if the
+  backend can, returning non-zero if the sectors have to be written instead.
+
+  drain() hands any writes the backend is still holding on to the kernel,
+  flush() additionally waits until they are on the card.
+*/
+typedef struct {
+  const char *name;
+  int (*open)(void);
+  void (*read)(const uint32_t first_sector, const uint32_t count, uint8_t *buffer);
+  void (*write)(const uint32_t first_sector, const uint32_t count, const uint8_t *buffer);
+  int (*erase)(const uint32_t first_sector, const uint32_t last_sector);
+  void (*drain)(void);
+  void (*flush)(void);
+  void (*close)(void);
+} sdcard_backend_t;
+
+const sdcard_backend_t *sdcard_backend = NULL;
+
+/*
+  Positioned I/O helpers. pread()/pwrite() may legitimately return short
+  counts (signals, block device boundaries), so keep going until the whole
+  request has been satisfied. Anything else is a hard error: we are about
+  to rewrite a partition table, so carrying on with garbage is not an option.
+*/
+static void io_error(const char *what, const char *name, const off_t offset)
+{
+  fprintf(stderr, "ERROR: %s of '%s' failed at byte offset $%llx: %s\n", what, name, (unsigned long long)offset,
+      errno ? strerror(errno) : "unexpected end of file");
+  exit(-1);
+}
+
+static void pread_full(const int fd, const char *name, void *buf, size_t len, off_t offset)
+{
+  ssize_t r;
+  uint8_t *p = buf;
+
+  while (len) {
+    errno = 0;
+    r = pread(fd, p, len, offset);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      io_error("read", name, offset);
+    p += r;
+    len -= r;
+    offset += r;
+  }
+}
+
+static void pwrite_full(const int fd, const char *name, const void *buf, size_t len, off_t offset)
+{
+  ssize_t r;
+  const uint8_t *p = buf;
+
+  while (len) {
+    errno = 0;
+    r = pwrite(fd, p, len, offset);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      io_error("write", name, offset);
+    p += r;
+    len -= r;
+    offset += r;
+  }
+}
+
+/*
+  Erasing for everything backed by a real file descriptor: ask the kernel
+  to zero the range without us pushing the zeroes through write().
+  Returns 0 if the range is now known to read back as zeroes.
+*/
+static int fd_erase(const uint32_t first_sector, const uint32_t last_sector)
+{
+  struct stat s;
+  uint64_t range[2];
+
+  range[0] = first_sector * 512ULL;
+  range[1] = (last_sector - first_sector + 1) * 512ULL;
+
+  if (fstat(sdcard_fd, &s))
+    return -1;
+
+  if (S_ISBLK(s.st_mode)) {
+#ifdef BLKZEROOUT
+    // Lets the device use WRITE ZEROES / TRIM where it can
+    if (!ioctl(sdcard_fd, BLKZEROOUT, range))
+      return 0;
+#endif
+#ifdef BLKDISCARD
+    // Without that, a discard is only a hint: it lets the card erase its
+    // blocks ahead of the zeroes the caller then writes. It never counts as
+    // an erase, as many SD cards don't read back zeroes after one (and
+    // current kernels never promise that they do).
+    ioctl(sdcard_fd, BLKDISCARD, range);
+#endif
+    return -1;
+  }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  // Image files: deallocating the range keeps the image sparse
+  if (!fallocate(sdcard_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]))
+    return 0;
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+  if (!fallocate(sdcard_fd, FALLOC_FL_ZERO_RANGE, range[0], range[1]))
+    return 0;
+#endif
+  return -1;
+}
+
+/*
+  pread()/pwrite() backend: works for anything we can open. A single
+  contiguous buffer needs no scatter/gather, so one call covers a whole run.
+*/
+static int fd_open(void)
+{
+  return 0;
+}
+
+static void fd_read(const uint32_t first_sector, const uint32_t count, uint8_t *buffer)
+{
+  pread_full(sdcard_fd, sdcard_name, buffer, count * 512ULL, first_sector * 512ULL);
+}
+
+static void fd_write(const uint32_t first_sector, const uint32_t count, const uint8_t *buffer)
+{
+  pwrite_full(sdcard_fd, sdcard_name, buffer, count * 512ULL, first_sector * 512ULL);
+}
+
+static void nothing_pending(void)
+{
+}
+
+static void fd_flush(void)
+{
+  if (fsync(sdcard_fd))
+    io_error("fsync", sdcard_name, 0);
+}
+
+static void fd_close(void)
+{
+}
+
+static const sdcard_backend_t fd_backend = { "pread", fd_open, fd_read, fd_write, fd_erase, nothing_pending, fd_flush, fd_close };
+
+/*
+  mmap() backend for image files: sector transfers become memcpy() into
+  the page cache, and the dirty part of the image is written back with a
+  single msync() from sdcard_flush().
+*/
+static uint8_t *mmap_base = NULL;
+static uint64_t mmap_dirty_start, mmap_dirty_end;
+
+static int mmap_open(void)
+{
+  struct stat s;
+
+  if (fstat(sdcard_fd, &s) || !S_ISREG(s.st_mode) || !sdcard_bytes)
+    return -1;
+  mmap_base = mmap(NULL, sdcard_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, sdcard_fd, 0);
+  if (mmap_base == MAP_FAILED) {
+    mmap_base = NULL;
+    return -1;
+  }
+  mmap_dirty_start = sdcard_bytes;
+  mmap_dirty_end = 0;
+  return 0;
+}
+
+static void check_sector_range(const char *what, const uint32_t first_sector, const uint32_t count)
+{
+  // For backends that hold the card in memory, running off the end would
+  // be a SIGBUS or a wild pointer, rather than a failed read or write
+  if ((first_sector + (uint64_t)count) * 512 > sdcard_bytes) {
+    errno = 0;
+    io_error(what, sdcard_name, first_sector * 512ULL);
+  }
+}
+
+static void mmap_read(const uint32_t first_sector, const uint32_t count, uint8_t *buffer)
+{
+  check_sector_range("read", first_sector, count);
+  memcpy(buffer, mmap_base + first_sector * 512ULL, count * 512ULL);
+}
+
+static void mmap_write(const uint32_t first_sector, const uint32_t count, const uint8_t *buffer)
+{
+  uint64_t start = first_sector * 512ULL, end = start + count * 512ULL;
+
+  check_sector_range("write", first_sector, count);
+  memcpy(mmap_base + start, buffer, count * 512ULL);
+  if (start < mmap_dirty_start)
+    mmap_dirty_start = start;
+  if (end > mmap_dirty_end)
+    mmap_dirty_end = end;
+}
+
+static void mmap_flush(void)
+{
+  uint64_t start;
+
+  if (mmap_dirty_end <= mmap_dirty_start)
+    return;
+  start = mmap_dirty_start & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+  if (msync(mmap_base + start, mmap_dirty_end - start, MS_SYNC))
+    io_error("msync", sdcard_name, start);
+  mmap_dirty_start = sdcard_bytes;
+  mmap_dirty_end = 0;
+}
+
+static void mmap_close(void)
+{
+  munmap(mmap_base, sdcard_bytes);
+  mmap_base = NULL;
+}
+
+static const sdcard_backend_t mmap_backend = { "mmap", mmap_open, mmap_read, mmap_write, fd_erase, nothing_pending,
+  mmap_flush, mmap_close };
+
+/*
+  O_DIRECT backend for physical cards: bypasses the page cache, so data
+  goes to the card once and completion times are honest. O_DIRECT needs
+  block aligned offsets, lengths and buffers, so consecutive sector writes
+  are gathered in a page aligned staging buffer and pushed out as large
+  aligned transfers, reading back the partial blocks at either end.
+*/
+#define DIRECT_STAGING_BYTES (1024 * 1024)
+#define DIRECT_STAGING_SECTORS (DIRECT_STAGING_BYTES / 512)
+
+static int direct_fd = -1;
+static uint8_t *direct_stage = NULL, *direct_bounce = NULL;
+static uint32_t direct_align = 1;            // transfer granularity in sectors
+static uint32_t direct_base;                 // aligned sector held at the start of direct_stage
+static uint32_t direct_first, direct_end;    // staged sectors are [direct_first, direct_end)
+
+#define direct_round_down(S) ((S) - (S) % direct_align)
+#define direct_round_up(S) direct_round_down((S) + direct_align - 1)
+
+static int direct_open(void)
+{
+  long page = sysconf(_SC_PAGESIZE);
+
+  direct_fd = open(sdcard_name, O_RDWR | O_DIRECT);
+  if (direct_fd < 0)
+    return -1;
+
+  // Writing whole physical blocks keeps the card from doing its own
+  // read-modify-write
+  direct_align = sdcard_physical_block_size / 512;
+  if (direct_align < sdcard_logical_block_size / 512)
+    direct_align = sdcard_logical_block_size / 512;
+  if (!direct_align || DIRECT_STAGING_SECTORS % direct_align)
+    direct_align = 1;
+  fprintf(stderr, "O_DIRECT: %u byte logical, %u byte physical blocks.\n", sdcard_logical_block_size,
+      sdcard_physical_block_size);
+
+  if (!direct_stage && (posix_memalign((void **)&direct_stage, page, DIRECT_STAGING_BYTES)
+                           || posix_memalign((void **)&direct_bounce, page, DIRECT_STAGING_BYTES))) {
+    perror("posix_memalign");
+    exit(-1);
+  }
+
+  // Some file systems accept O_DIRECT at open() time, but then refuse the I/O
+  if (pread(direct_fd, direct_bounce, direct_align * 512, 0) < 0) {
+    close(direct_fd);
+    direct_fd = -1;
+    return -1;
+  }
+
+  direct_first = direct_end = 0;
+  return 0;
+}
+
+// Fill part of the staging buffer (within one aligned block) from the card
+static void direct_fill_from_card(const uint32_t first_sector, const uint32_t end_sector)
+{
+  uint32_t block = direct_round_down(first_sector);
+
+  pread_full(direct_fd, sdcard_name, direct_bounce, direct_align * 512, block * 512ULL);
+  memcpy(direct_stage + (first_sector - direct_base) * 512, direct_bounce + (first_sector - block) * 512,
+      (end_sector - first_sector) * 512);
+}
+
+static void direct_drain(void)
+{
+  uint32_t aligned_end;
+
+  if (direct_first == direct_end)
+    return;
+
+  aligned_end = direct_round_up(direct_end);
+  if (direct_first != direct_base)
+    direct_fill_from_card(direct_base, direct_first);
+  if (direct_end != aligned_end)
+    direct_fill_from_card(direct_end, aligned_end);
+  pwrite_full(direct_fd, sdcard_name, direct_stage, (aligned_end - direct_base) * 512ULL, direct_base * 512ULL);
+
+  direct_first = direct_end = 0;
+}
+
+static void direct_write(uint32_t first_sector, uint32_t count, const uint8_t *buffer)
+{
+  uint32_t n;
+
+  while (count) {
+    // Only a write that carries on where the staged run ends can join it
+    if (direct_first == direct_end || first_sector != direct_end) {
+      direct_drain();
+      direct_base = direct_round_down(first_sector);
+      direct_first = direct_end = first_sector;
+    }
+    n = DIRECT_STAGING_SECTORS - (direct_end - direct_base);
+    if (!n) {
+      direct_drain();
+      continue;
+    }
+    if (n > count)
+      n = count;
+    memcpy(direct_stage + (direct_end - direct_base) * 512, buffer, n * 512);
+    direct_end += n;
+    first_sector += n;
+    buffer += n * 512;
+    count -= n;
+  }
+}
+
+static void direct_read(uint32_t first_sector, uint32_t count, uint8_t *buffer)
+{
+  uint32_t base, n;
+
+  if (first_sector < direct_end && first_sector + count > direct_first)
+    direct_drain();
+
+  while (count) {
+    base = direct_round_down(first_sector);
+    n = count;
+    if (first_sector - base + n > DIRECT_STAGING_SECTORS)
+      n = DIRECT_STAGING_SECTORS - (first_sector - base);
+    pread_full(direct_fd, sdcard_name, direct_bounce, (direct_round_up(first_sector + n) - base) * 512ULL,
+        base * 512ULL);
+    memcpy(buffer, direct_bounce + (first_sector - base) * 512, n * 512);
+    first_sector += n;
+    buffer += n * 512;
+    count -= n;
+  }
+}
+
+static void direct_flush(void)
+{
+  direct_drain();
+  // O_DIRECT skips the page cache, but not the card's own write cache
+  if (fdatasync(direct_fd))
+    io_error("fdatasync", sdcard_name, 0);
+}
+
+static void direct_close(void)
+{
+  direct_drain();
+  close(direct_fd);
+  direct_fd = -1;
+}
+
+static const sdcard_backend_t direct_backend = { "direct", direct_open, direct_read, direct_write, fd_erase, direct_drain,
+  direct_flush, direct_close };
+
+#ifdef __NR_io_uring_setup
+/*
+  io_uring backend: USB card readers only reach their rated speed with
+  several requests outstanding, so writes are queued (up to
+  SDCARDQUEUEDEPTH at a time, default 16) and reaped as they complete.
+  We talk to the kernel directly rather than depend on liburing.
+
+  Each queued write owns a copy of its data, in its own slot of one
+  page aligned buffer set up when the card is opened; writes bigger than
+  a slot go out as several requests. The kernel may complete
+  queued requests in any order, so a write that overlaps one still in
+  flight (e.g., rewriting a FAT sector) waits for the queue to empty
+  first, and reads of sectors still being written do the same. Writes to
+  the MBR are a barrier: they only start once everything before them is
+  done.
+
+  For block devices with 512 byte logical sectors, requests go out with
+  O_DIRECT so that they really are in flight at the card, rather than
+  just being copied into the page cache.
+*/
+#define URING_DEFAULT_DEPTH 16
+#define URING_MAX_DEPTH 256
+#define URING_SLOT_SECTORS MULTI_SECTOR_COUNT
+#define URING_SLOT_BYTES (URING_SLOT_SECTORS * 512)
+
+typedef struct {
+  uint8_t *buffer;
+  struct iovec iov;
+  uint32_t first_sector, count;
+  uint8_t busy;
+} uring_request_t;
+
+static int uring_ring_fd = -1, uring_io_fd = -1, uring_io_direct = 0;
+static unsigned uring_depth, uring_in_flight;
+static uring_request_t uring_requests[URING_MAX_DEPTH];
+static struct io_uring_sqe *uring_sqes;
+static unsigned *uring_sq_tail, *uring_sq_mask, *uring_sq_array;
+static unsigned *uring_cq_head, *uring_cq_tail, *uring_cq_mask;
+static struct io_uring_cqe *uring_cqes;
+static void *uring_sq_ring, *uring_cq_ring;
+static size_t uring_sq_ring_size, uring_cq_ring_size, uring_sqes_size;
+// A slot for each request, then one for bouncing O_DIRECT reads
+static uint8_t *uring_buffers;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  int r;
+
+  do
+    r = syscall(__NR_io_uring_enter, uring_ring_fd, to_submit, min_complete, flags, NULL, 0);
+  while (r < 0 && errno == EINTR);
+  return r;
+}
+
+static int uring_open(void)
+{
+  struct io_uring_params params;
+  struct stat s;
+  unsigned i;
+  const char *depth = getenv("SDCARDQUEUEDEPTH");
+
+  uring_depth = depth ? atoi(depth) : URING_DEFAULT_DEPTH;
+  if (uring_depth < 1)
+    uring_depth = 1;
+  if (uring_depth > URING_MAX_DEPTH)
+    uring_depth = URING_MAX_DEPTH;
+
+  if (posix_memalign((void **)&uring_buffers, sysconf(_SC_PAGESIZE), (uring_depth + 1) * URING_SLOT_BYTES))
+    return -1;
+
+  memset(&params, 0, sizeof(params));
+  uring_ring_fd = syscall(__NR_io_uring_setup, uring_depth, &params);
+  if (uring_ring_fd < 0) {
+    free(uring_buffers);
+    return -1;
+  }
+
+  uring_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  uring_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring_cq_ring_size > uring_sq_ring_size)
+      uring_sq_ring_size = uring_cq_ring_size;
+    uring_cq_ring_size = uring_sq_ring_size;
+  }
+  uring_sq_ring = mmap(NULL, uring_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_ring_fd,
+      IORING_OFF_SQ_RING);
+  uring_cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+      ? uring_sq_ring
+      : mmap(NULL, uring_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_ring_fd,
+          IORING_OFF_CQ_RING);
+  uring_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring_sqes
+      = mmap(NULL, uring_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_ring_fd, IORING_OFF_SQES);
+  if (uring_sq_ring == MAP_FAILED || uring_cq_ring == MAP_FAILED || uring_sqes == MAP_FAILED) {
+    // Don't leak whichever of them did work
+    if (uring_sqes != MAP_FAILED)
+      munmap(uring_sqes, uring_sqes_size);
+    if (uring_cq_ring != MAP_FAILED && uring_cq_ring != uring_sq_ring)
+      munmap(uring_cq_ring, uring_cq_ring_size);
+    if (uring_sq_ring != MAP_FAILED)
+      munmap(uring_sq_ring, uring_sq_ring_size);
+    close(uring_ring_fd);
+    free(uring_buffers);
+    uring_ring_fd = -1;
+    return -1;
+  }
+
+  uring_sq_tail = (unsigned *)((uint8_t *)uring_sq_ring + params.sq_off.tail);
+  uring_sq_mask = (unsigned *)((uint8_t *)uring_sq_ring + params.sq_off.ring_mask);
+  uring_sq_array = (unsigned *)((uint8_t *)uring_sq_ring + params.sq_off.array);
+  uring_cq_head = (unsigned *)((uint8_t *)uring_cq_ring + params.cq_off.head);
+  uring_cq_tail = (unsigned *)((uint8_t *)uring_cq_ring + params.cq_off.tail);
+  uring_cq_mask = (unsigned *)((uint8_t *)uring_cq_ring + params.cq_off.ring_mask);
+  uring_cqes = (struct io_uring_cqe *)((uint8_t *)uring_cq_ring + params.cq_off.cqes);
+
+  uring_io_fd = sdcard_fd;
+  uring_io_direct = 0;
+  if (!fstat(sdcard_fd, &s) && S_ISBLK(s.st_mode) && sdcard_logical_block_size == 512) {
+    int fd = open(sdcard_name, O_RDWR | O_DIRECT);
+    if (fd >= 0) {
+      uring_io_fd = fd;
+      uring_io_direct = 1;
+    }
+  }
+
+  for (i = 0; i < uring_depth; i++)
+    uring_requests[i].buffer = uring_buffers + i * URING_SLOT_BYTES;
+  uring_in_flight = 0;
+  fprintf(stderr, "io_uring: queue depth %u%s.\n", uring_depth, uring_io_direct ? ", O_DIRECT" : "");
+  return 0;
+}
+
+// Retire whatever has completed, waiting for at least min_complete requests
+static void uring_reap(unsigned min_complete)
+{
+  unsigned head;
+  struct io_uring_cqe *cqe;
+  uring_request_t *req;
+
+  if (min_complete && uring_enter(0, min_complete, IORING_ENTER_GETEVENTS) < 0)
+    io_error("io_uring_enter", sdcard_name, 0);
+
+  head = *uring_cq_head;
+  while (head != __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &uring_cqes[head & *uring_cq_mask];
+    req = &uring_requests[cqe->user_data];
+    if (cqe->res < 0) {
+      errno = -cqe->res;
+      io_error("write", sdcard_name, req->first_sector * 512ULL);
+    }
+    // Short writes are rare enough to just finish synchronously
+    if ((uint32_t)cqe->res < req->count * 512)
+      pwrite_full(uring_io_fd, sdcard_name, req->buffer + cqe->res, req->count * 512 - cqe->res,
+          req->first_sector * 512ULL + cqe->res);
+    req->busy = 0;
+    uring_in_flight--;
+    head++;
+  }
+  __atomic_store_n(uring_cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_drain(void)
+{
+  while (uring_in_flight)
+    uring_reap(1);
+}
+
+static int uring_overlaps_in_flight(const uint32_t first_sector, const uint32_t count)
+{
+  unsigned i;
+
+  for (i = 0; i < uring_depth; i++)
+    if (uring_requests[i].busy && first_sector < uring_requests[i].first_sector + uring_requests[i].count
+        && first_sector + count > uring_requests[i].first_sector)
+      return 1;
+  return 0;
+}
+
+// Queue a write of at most one slot
+static void uring_queue(const uint32_t first_sector, const uint32_t count, const uint8_t *buffer)
+{
+  unsigned i, tail, index;
+  struct io_uring_sqe *sqe;
+  uring_request_t *req;
+
+  if (uring_overlaps_in_flight(first_sector, count))
+    uring_drain();
+  if (uring_in_flight == uring_depth)
+    uring_reap(1);
+  for (i = 0; uring_requests[i].busy; i++)
+    continue;
+  req = &uring_requests[i];
+
+  memcpy(req->buffer, buffer, count * 512ULL);
+  req->first_sector = first_sector;
+  req->count = count;
+  req->iov.iov_base = req->buffer;
+  req->iov.iov_len = count * 512ULL;
+  req->busy = 1;
+
+  tail = *uring_sq_tail;
+  index = tail & *uring_sq_mask;
+  sqe = &uring_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = uring_io_fd;
+  sqe->addr = (unsigned long)&req->iov;
+  sqe->len = 1;
+  sqe->off = first_sector * 512ULL;
+  sqe->user_data = i;
+  // Nothing overtakes the partition table
+  if (!first_sector)
+    sqe->flags |= IOSQE_IO_DRAIN;
+  uring_sq_array[index] = index;
+  __atomic_store_n(uring_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring_in_flight++;
+
+  if (uring_enter(1, 0, 0) < 0)
+    io_error("io_uring_enter", sdcard_name, first_sector * 512ULL);
+
+  // Don't let completions pile up unseen
+  uring_reap(0);
+}
+
+static void uring_write(const uint32_t first_sector, const uint32_t count, const uint8_t *buffer)
+{
+  uint32_t done, batch;
+
+  for (done = 0; done < count; done += batch) {
+    batch = count - done < URING_SLOT_SECTORS ? count - done : URING_SLOT_SECTORS;
+    uring_queue(first_sector + done, batch, buffer + done * 512ULL);
+  }
+}
+
+static void uring_read(const uint32_t first_sector, const uint32_t count, uint8_t *buffer)
+{
+  uint8_t *bounce = uring_buffers + uring_depth * URING_SLOT_BYTES;
+  uint32_t done, batch;
+
+  if (uring_overlaps_in_flight(first_sector, count))
+    uring_drain();
+  if (!uring_io_direct) {
+    pread_full(uring_io_fd, sdcard_name, buffer, count * 512ULL, first_sector * 512ULL);
+    return;
+  }
+  for (done = 0; done < count; done += batch) {
+    batch = count - done < URING_SLOT_SECTORS ? count - done : URING_SLOT_SECTORS;
+    pread_full(uring_io_fd, sdcard_name, bounce, batch * 512ULL, (first_sector + done) * 512ULL);
+    memcpy(buffer + done * 512ULL, bounce, batch * 512ULL);
+  }
+}
+
+static void uring_flush(void)
+{
+  uring_drain();
+  if (fdatasync(uring_io_fd))
+    io_error("fdatasync", sdcard_name, 0);
+}
+
+static void uring_close(void)
+{
+  uring_drain();
+  munmap(uring_sqes, uring_sqes_size);
+  if (uring_cq_ring != uring_sq_ring)
+    munmap(uring_cq_ring, uring_cq_ring_size);
+  munmap(uring_sq_ring, uring_sq_ring_size);
+  close(uring_ring_fd);
+  uring_ring_fd = -1;
+  if (uring_io_direct)
+    close(uring_io_fd);
+  uring_io_fd = -1;
+  free(uring_buffers);
+  uring_buffers = NULL;
+}
+
+static const sdcard_backend_t uring_backend = { "uring", uring_open, uring_read, uring_write, fd_erase, uring_drain,
+  uring_flush, uring_close };
+#endif
+
+/*
+  RAM disk backend: the whole card lives in memory, for tests and for
+  building images without touching a file system. Memory is handed out in
+  1MB chunks on first non-zero write, so even a 2TB card only costs what is
+  actually written. The size comes from SDCARDSIZE (e.g., 1G) and, if
+  SDCARDDUMP is set, sdcard_flush() writes the image there as a sparse
+  file. A RAM disk starts blank every time the card is opened.
+*/
+#define RAM_CHUNK_SECTORS 2048
+#define RAM_CHUNK_BYTES (RAM_CHUNK_SECTORS * 512)
+
+static uint8_t **ram_chunks = NULL;
+static uint32_t ram_chunk_count = 0;
+
+static int ram_open(void)
+{
+  ram_chunk_count = (sdcard_bytes / 512 + RAM_CHUNK_SECTORS - 1) / RAM_CHUNK_SECTORS;
+  ram_chunks = calloc(ram_chunk_count ? ram_chunk_count : 1, sizeof(*ram_chunks));
+  return ram_chunks ? 0 : -1;
+}
+
+static int ram_is_zero(const uint8_t *buffer, uint32_t len)
+{
+  while (len--)
+    if (*buffer++)
+      return 0;
+  return 1;
+}
+
+static void ram_read(uint32_t first_sector, uint32_t count, uint8_t *buffer)
+{
+  uint32_t chunk, offset, n;
+
+  check_sector_range("read", first_sector, count);
+  while (count) {
+    chunk = first_sector / RAM_CHUNK_SECTORS;
+    offset = first_sector % RAM_CHUNK_SECTORS;
+    n = RAM_CHUNK_SECTORS - offset;
+    if (n > count)
+      n = count;
+    if (ram_chunks[chunk])
+      memcpy(buffer, ram_chunks[chunk] + offset * 512, n * 512);
+    else
+      memset(buffer, 0, n * 512);
+    first_sector += n;
+    buffer += n * 512;
+    count -= n;
+  }
+}
+
+static void ram_write(uint32_t first_sector, uint32_t count, const uint8_t *buffer)
+{
+  uint32_t chunk, offset, n;
+
+  check_sector_range("write", first_sector, count);
+  while (count) {
+    chunk = first_sector / RAM_CHUNK_SECTORS;
+    offset = first_sector % RAM_CHUNK_SECTORS;
+    n = RAM_CHUNK_SECTORS - offset;
+    if (n > count)
+      n = count;
+    if (!ram_chunks[chunk] && !ram_is_zero(buffer, n * 512)) {
+      ram_chunks[chunk] = calloc(1, RAM_CHUNK_BYTES);
+      if (!ram_chunks[chunk]) {
+        perror("calloc");
+        exit(-1);
+      }
+    }
+    if (ram_chunks[chunk])
+      memcpy(ram_chunks[chunk] + offset * 512, buffer, n * 512);
+    first_sector += n;
+    buffer += n * 512;
+    count -= n;
+  }
+}
+
+static int ram_erase(const uint32_t first_sector, const uint32_t last_sector)
+{
+  uint32_t sector = first_sector, chunk, offset, n;
+
+  check_sector_range("erase", first_sector, last_sector - first_sector + 1);
+  while (sector <= last_sector) {
+    chunk = sector / RAM_CHUNK_SECTORS;
+    offset = sector % RAM_CHUNK_SECTORS;
+    n = RAM_CHUNK_SECTORS - offset;
+    if (n > last_sector - sector + 1)
+      n = last_sector - sector + 1;
+    if (n == RAM_CHUNK_SECTORS) {
+      free(ram_chunks[chunk]);
+      ram_chunks[chunk] = NULL;
+    }
+    else if (ram_chunks[chunk])
+      memset(ram_chunks[chunk] + offset * 512, 0, n * 512);
+    sector += n;
+    if (!sector)
+      break;
+  }
+  return 0;
+}
+
+static void ram_flush(void)
+{
+  const char *dump = getenv("SDCARDDUMP");
+  uint64_t offset, len;
+  uint32_t chunk;
+  int fd;
+
+  if (!dump || !*dump)
+    return;
+  fd = open(dump, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, sdcard_bytes))
+    io_error("create", dump, 0);
+  for (chunk = 0; chunk < ram_chunk_count; chunk++) {
+    if (!ram_chunks[chunk])
+      continue;
+    offset = chunk * (uint64_t)RAM_CHUNK_BYTES;
+    len = sdcard_bytes - offset;
+    if (len > RAM_CHUNK_BYTES)
+      len = RAM_CHUNK_BYTES;
+    pwrite_full(fd, dump, ram_chunks[chunk], len, offset);
+  }
+  close(fd);
+}
+
+static void ram_close(void)
+{
+  uint32_t chunk;
+
+  for (chunk = 0; chunk < ram_chunk_count; chunk++)
+    free(ram_chunks[chunk]);
+  free(ram_chunks);
+  ram_chunks = NULL;
+  ram_chunk_count = 0;
+}
+
+static const sdcard_backend_t ram_backend = { "ram", ram_open, ram_read, ram_write, ram_erase, nothing_pending,
+  ram_flush, ram_close };
+
+static const sdcard_backend_t *sdcard_backends[] = { &ram_backend,  &fd_backend, &mmap_backend, &direct_backend,
+#ifdef __NR_io_uring_setup
+  &uring_backend,
+#endif
+  NULL };
 
 unsigned char get_random_byte(void)
 {
@@ -27,8 +846,12 @@ void sdcard_select(unsigned char n)
 
 void sdcard_readsector(const uint32_t sector_number)
 {
-  fseek(sdcard, sector_number * 512LL, SEEK_SET);
-  fread(sector_buffer, 512, 1, sdcard);
+  sdcard_backend->read(sector_number, 1, sector_buffer);
+}
+
+void sdcard_readsectors(const uint32_t first_sector, const uint16_t count, uint8_t *buffer)
+{
+  sdcard_backend->read(first_sector, count, buffer);
 }
 
 void sdcard_readspeed_test(void)
@@ -43,77 +866,316 @@ void sdcard_map_sector_buffer(void)
 {
 }
 
-uint32_t sdcard_getsize(void)
+static void sdcard_detect_size(void)
 {
   struct stat s;
+  unsigned long long bytes;
 
-  if (!sdcard) {
-    fprintf(stderr, "SD card not open.\n");
+  if (fstat(sdcard_fd, &s)) {
+    perror("stat");
     exit(-1);
   }
 
-  int r = fstat(fileno(sdcard), &s);
+  bytes = s.st_size;
+  // For image files, the file system block is the natural unit
+  sdcard_logical_block_size = 512;
+  sdcard_physical_block_size = s.st_blksize > 512 ? s.st_blksize : 512;
+#ifdef BLKGETSIZE64
+  // Block devices report a size of zero via stat(), so ask the kernel
+  if (S_ISBLK(s.st_mode)) {
+    int block_size;
 
-  if (r) {
-    perror("stat");
+    if (ioctl(sdcard_fd, BLKGETSIZE64, &bytes)) {
+      perror("ioctl(BLKGETSIZE64)");
+      exit(-1);
+    }
+    if (!ioctl(sdcard_fd, BLKSSZGET, &block_size) && block_size >= 512)
+      sdcard_logical_block_size = block_size;
+    if (!ioctl(sdcard_fd, BLKPBSZGET, &block_size) && block_size >= 512)
+      sdcard_physical_block_size = block_size;
+    else
+      sdcard_physical_block_size = sdcard_logical_block_size;
+  }
+#endif
+
+  // MBR partition entries are limited to 32-bit sector numbers
+  if (bytes / 512 > 0xffffffffULL) {
+    fprintf(stderr, "WARNING: Only the first 2TiB of the SD card will be used.\n");
+    bytes = 0xffffffffULL * 512;
+  }
+  sdcard_bytes = bytes & ~511ULL;
+}
+
+uint32_t sdcard_getsize(void)
+{
+  if (!sdcard_backend) {
+    fprintf(stderr, "SD card not open.\n");
     exit(-1);
   }
 
-  fprintf(stderr, "Size = $%08X sectors.\n", (unsigned int)(16000000000LL / 512LL));
-  //  return s.st_size/512;
-  return 16000000000LL / 512;
+  fprintf(stderr, "Size = $%08X sectors.\n", (unsigned int)(sdcard_bytes / 512));
+  return sdcard_bytes / 512;
+}
+
+// Sizes like "4G", "512M" or a plain number of bytes
+static uint64_t parse_size(const char *text)
+{
+  char *end;
+  uint64_t size;
+
+  if (!text)
+    return 0;
+  size = strtoull(text, &end, 0);
+  switch (*end) {
+  case 'T':
+  case 't':
+    size <<= 10; // fall through
+  case 'G':
+  case 'g':
+    size <<= 10; // fall through
+  case 'M':
+  case 'm':
+    size <<= 10; // fall through
+  case 'K':
+  case 'k':
+    size <<= 10;
+  }
+  if (size / 512 > 0xffffffffULL)
+    size = 0xffffffffULL * 512;
+  return size & ~511ULL;
+}
+
+// Don't let queued or staged writes be lost if we exit early
+static void sdcard_drain_at_exit(void)
+{
+  if (sdcard_backend)
+    sdcard_backend->drain();
 }
 
 void sdcard_open(void)
 {
+  static int registered_exit_handler = 0;
+  const char *name;
+  int i;
+
   srand(time(NULL));
+  if (!registered_exit_handler) {
+    atexit(sdcard_drain_at_exit);
+    registered_exit_handler = 1;
+  }
 
-  if (!getenv("SDCARDFILE")) {
-    fprintf(stderr, "ERROR: Environment variable 'SDCARDFILE' not found!\n");
-    fprintf(stderr, "- Please set it to either:\n"
-                    "  - a file (e.g., 'sdcard.bin')\n"
-                    "  - or your sd-card device (e.g., '/dev/sdb')\n"
-                    "\n"
-                    "- Also consider setting 'FLASHFILE' env-var to point to a .cor file\n");
+  // main() and open_sdcard_and_retrieve_details() both open the card
+  if (sdcard_backend) {
+    sdcard_backend->close();
+    sdcard_backend = NULL;
+  }
+  if (sdcard_fd >= 0)
+    close(sdcard_fd);
+  sdcard_fd = -1;
 
-    exit(1);
+  // Look at FLASHFILE again when it is next read, in case it has changed
+  if (flash_map)
+    munmap(flash_map, flash_bytes);
+  flash_map = NULL;
+  if (flash_fd >= 0)
+    close(flash_fd);
+  flash_fd = -1;
+  first_flash_read = 1;
+
+  sdcard_session_reset();
+  name = getenv("SDCARDCOMPARE");
+  if (name && *name) {
+    if (!strcmp(name, "always"))
+      sdcard_compare_policy = SDCARD_COMPARE_ALWAYS;
+    else if (!strcmp(name, "never"))
+      sdcard_compare_policy = SDCARD_COMPARE_NEVER;
+    else if (!strcmp(name, "erased"))
+      sdcard_compare_policy = SDCARD_COMPARE_ERASED;
+    else {
+      fprintf(stderr, "ERROR: SDCARDCOMPARE must be one of 'always', 'never' or 'erased'.\n");
+      exit(1);
+    }
+  }
+  name = getenv("SDCARDVERIFY");
+  if (name && *name) {
+    if (!strcmp(name, "none"))
+      sdcard_verify_mode = SDCARD_VERIFY_NONE;
+    else if (!strncmp(name, "sampled", 7) && (!name[7] || (name[7] == ':' && atoi(name + 8) > 0))) {
+      sdcard_verify_mode = SDCARD_VERIFY_SAMPLED;
+      if (name[7])
+        sdcard_verify_interval = atoi(name + 8) > 0xffff ? 0xffff : atoi(name + 8);
+    }
+    else if (!strcmp(name, "deferred"))
+      sdcard_verify_mode = SDCARD_VERIFY_DEFERRED;
+    else if (!strcmp(name, "full"))
+      sdcard_verify_mode = SDCARD_VERIFY_FULL;
+    else {
+      fprintf(stderr, "ERROR: SDCARDVERIFY must be one of 'none', 'sampled[:N]', 'deferred' or 'full'.\n");
+      exit(1);
+    }
   }
 
-  sdcard = fopen(getenv("SDCARDFILE"), "r+");
-  if (!sdcard) {
-    fprintf(stderr, "Could not open '%s'...\n", getenv("SDCARDFILE"));
-    perror("fopen");
-    exit(-1);
+  name = getenv("SDCARDBACKEND");
+  if (name && !strcmp(name, "ram")) {
+    sdcard_name = "RAM disk";
+    sdcard_bytes = parse_size(getenv("SDCARDSIZE"));
+    if (!sdcard_bytes) {
+      fprintf(stderr, "ERROR: Please set 'SDCARDSIZE' (e.g., '4G') to the size of the RAM disk.\n");
+      exit(1);
+    }
+    sdcard_logical_block_size = sdcard_physical_block_size = 512;
+  }
+  else {
+    if (!getenv("SDCARDFILE")) {
+      fprintf(stderr, "ERROR: Environment variable 'SDCARDFILE' not found!\n");
+      fprintf(stderr, "- Please set it to either:\n"
+                      "  - a file (e.g., 'sdcard.bin')\n"
+                      "  - or your sd-card device (e.g., '/dev/sdb')\n"
+                      "  - or set 'SDCARDBACKEND' to 'ram' and 'SDCARDSIZE' to the size of a RAM disk\n"
+                      "\n"
+                      "- Also consider setting 'FLASHFILE' env-var to point to a .cor file\n");
+
+      exit(1);
+    }
+
+    sdcard_name = getenv("SDCARDFILE");
+    sdcard_fd = open(sdcard_name, O_RDWR);
+    if (sdcard_fd < 0) {
+      fprintf(stderr, "Could not open '%s'...\n", sdcard_name);
+      perror("open");
+      exit(-1);
+    }
+    sdcard_detect_size();
+
+    // Image files are mapped into memory and cards bypass the page cache,
+    // unless asked otherwise
+    if (!name || !*name) {
+      struct stat s;
+      name = "pread";
+      if (!fstat(sdcard_fd, &s)) {
+        if (S_ISREG(s.st_mode))
+          name = "mmap";
+        else if (S_ISBLK(s.st_mode))
+          name = "direct";
+      }
+    }
+  }
+
+  for (i = 0; sdcard_backends[i]; i++)
+    if (!strcmp(sdcard_backends[i]->name, name))
+      break;
+  if (!sdcard_backends[i]) {
+    fprintf(stderr, "ERROR: Unknown SDCARDBACKEND '%s'.\n", name);
+    exit(1);
   }
+  sdcard_backend = sdcard_backends[i];
+  if (sdcard_backend->open()) {
+    fprintf(stderr, "WARNING: Cannot use '%s' backend for '%s', using pread.\n", sdcard_backend->name, sdcard_name);
+    sdcard_backend = &fd_backend;
+    sdcard_backend->open();
+  }
+}
+
+void sdcard_flush(void)
+{
+  sdcard_backend->flush();
 }
 
+// Say how the read-before-write policy did
+void sdcard_report_stats(void)
+{
+  if (sdcard_compare_policy != SDCARD_COMPARE_NEVER)
+    fprintf(stderr, "Read-before-write: %u writes saved, %u compares wasted.\n", sdcard_compare_hits,
+        sdcard_compare_misses);
+}
+
+
 uint32_t write_count = 0;
 
 void sdcard_writesector(const uint32_t sector_number)
 {
-  const uint8_t *buffer = sector_buffer;
+  static uint8_t current[512];
+
+  switch (sdcard_write_action(sector_number)) {
+  case SDCARD_SKIP:
+    return;
+  case SDCARD_COMPARE:
+    sdcard_backend->read(sector_number, 1, current);
+    if (sdcard_compare_result(!memcmp(current, sector_buffer, 512)))
+      return;
+  }
 
-  fseek(sdcard, sector_number * 512LL, SEEK_SET);
-  fwrite(buffer, 512, 1, sdcard);
+  sdcard_note_written(sector_number, 1);
+  sdcard_backend->write(sector_number, 1, sector_buffer);
+  sdcard_verify_writes(sector_number, 1, sector_buffer);
 
   write_count++;
 }
 
+void sdcard_writesectors(const uint32_t first_sector, const uint16_t count, const uint8_t *buffer)
+{
+  sdcard_note_written(first_sector, count);
+  sdcard_backend->write(first_sector, count, buffer);
+  sdcard_verify_writes(first_sector, count, buffer);
+
+  write_count += count;
+}
+
+void sdcard_writesectors_from(const uint32_t first_sector, const uint16_t count, const long source_address)
+{
+  sdcard_writesectors(first_sector, count, (const uint8_t *)source_address);
+}
+
+// Largest chunk written at once when we have to zero sectors the slow way
+#define ERASE_CHUNK_BYTES (1024 * 1024)
+
 void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector)
 {
-  uint32_t n;
-  bzero(sector_buffer, 512);
+  static uint8_t *zeroes = NULL;
+  uint64_t offset, end, len;
+
+  if (last_sector < first_sector)
+    return;
 
   fprintf(stderr, "Erasing sectors %d..%d\n", first_sector, last_sector);
 
-  for (n = first_sector; n <= last_sector; n++)
-    sdcard_writesector(n);
-}
+  // Writes still held by the backend must not land on top of the zeroes
+  sdcard_backend->drain();
 
-static int first_flash_read = 1;
+  // Callers expect to be left with a blank sector buffer, whichever way the
+  // erase is done
+  if (!sdcard_backend->erase(first_sector, last_sector)) {
+    bzero(sector_buffer, 512);
+    sdcard_note_erased(first_sector, last_sector);
+    return;
+  }
+  bzero(sector_buffer, 512);
+
+  // Fall back to writing zeroes, but in big chunks rather than per sector
+  if (!zeroes) {
+    zeroes = calloc(1, ERASE_CHUNK_BYTES);
+    if (!zeroes) {
+      perror("calloc");
+      exit(-1);
+    }
+  }
+  offset = first_sector * 512ULL;
+  end = (last_sector + 1ULL) * 512ULL;
+  while (offset < end) {
+    len = end - offset;
+    if (len > ERASE_CHUNK_BYTES)
+      len = ERASE_CHUNK_BYTES;
+    sdcard_backend->write(offset / 512, len / 512, zeroes);
+    write_count += len / 512;
+    offset += len;
+  }
+  sdcard_note_erased(first_sector, last_sector);
+}
 
 void open_flash_file(void)
 {
+  struct stat st;
+
   if (!getenv("FLASHFILE")) {
     fprintf(stderr, "ERROR: Environment variable 'FLASHFILE' not found!\n");
     exit(1);
@@ -121,18 +1183,59 @@ void open_flash_file(void)
 
   fprintf(stderr, "FLASHFILE=%s\n", getenv("FLASHFILE"));
 
-  flash = fopen(getenv("FLASHFILE"), "rb+");
+  flash_fd = open(getenv("FLASHFILE"), O_RDONLY);
+  if (flash_fd < 0) {
+    fprintf(stderr, "WARNING: Could not open '%s' (%s), no embedded files will be found.\n", getenv("FLASHFILE"),
+        strerror(errno));
+    return;
+  }
+
+  // Map the whole core once, rather than reading it in little pieces.
+  // If that is not possible, fall back to pread().
+  if (!fstat(flash_fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    flash_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, flash_fd, 0);
+    if (flash_map == MAP_FAILED)
+      flash_map = NULL;
+    else
+      flash_bytes = st.st_size;
+  }
 }
 
-void flash_read512bytes(const uint32_t byte_offset)
+void flash_read(const uint32_t byte_offset, const uint32_t length, long destination_address)
 {
+  uint8_t *dest = (uint8_t *)destination_address;
+  uint32_t done = 0;
+  ssize_t r;
+
   if (first_flash_read) {
     first_flash_read = 0;
     open_flash_file();
   }
 
-  fseek(flash, byte_offset, SEEK_SET);
-  fread(sector_buffer, 512, 1, flash);
+  // Anything past the end of the core (or without one at all) reads as zeroes
+  bzero(dest, length);
+  if (flash_map) {
+    if (byte_offset < flash_bytes)
+      memcpy(dest, flash_map + byte_offset, flash_bytes - byte_offset < length ? flash_bytes - byte_offset : length);
+    return;
+  }
+  if (flash_fd < 0)
+    return;
+  while (done < length) {
+    r = pread(flash_fd, dest + done, length - done, byte_offset + (off_t)done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      io_error("read", getenv("FLASHFILE"), byte_offset + (off_t)done);
+    if (!r)
+      break;
+    done += r;
+  }
+}
+
+void flash_read512bytes(const uint32_t byte_offset)
+{
+  flash_read(byte_offset, 512, (long)sector_buffer);
 }
 
 unsigned char mega65_getkey(void)
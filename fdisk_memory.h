@@ -4,6 +4,15 @@ unsigned char lpeek(long address);
 void lpoke(long address, unsigned char value);
 void lcopy(long source_address, long destination_address, unsigned int count);
 void lfill(long destination_address, unsigned char value, unsigned int count);
+
+// Free chip RAM above the first 128KB, for buffers that will not fit below
+// the screen
+#define SECTOR_CACHE_ADDRESS (0x40000L) // 64 x 512 bytes
+#define STAGING_ADDRESS (0x48000L)      // 64 x 512 bytes
+#define STAGING_SECTORS 64
+#define FREE_BITMAP_ADDRESS (0x50000L)  // 64KB
+#define FREE_BITMAP_BYTES (0x10000UL)
+
 #ifdef __CC65__
 #define POKE(X, Y) (*(unsigned char *)(X)) = Y
 #define PEEK(X) (*(unsigned char *)(X))
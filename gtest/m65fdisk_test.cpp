@@ -2,11 +2,135 @@
 #include "gmock/gmock.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+#include "../fdisk_fat_scan.h"
+#include "../fdisk_fat32.h"
+#include "../fdisk_geometry.h"
 
 extern int real_main(int argc, char **argv);
 extern int format_disk(void);
 extern void open_sdcard_and_retrieve_details(void);
+extern unsigned char existing_file_system_unclean(void);
+extern void repair_existing_file_system(void);
 extern int are_there_gaps_between_files(void);
+extern uint8_t sector_buffer[512];
+extern void sdcard_readsector(const uint32_t sector_number);
+extern uint32_t fat_partition_start;
+extern uint32_t fat_partition_sectors;
+extern uint32_t reserved_sectors;
+extern uint32_t fat_sectors;
+extern uint32_t fat1_sector;
+extern uint32_t fat2_sector;
+extern uint32_t rootdir_sector;
+extern uint32_t fs_clusters;
+extern long fat32_create_contiguous_file(char *name, long size, long root_dir_sector);
+extern void sector_cache_flush(void);
+extern void sector_cache_invalidate(void);
+extern void fat32_mirror_begin(void);
+extern void fat32_mirror_finish(void);
+extern unsigned char fat32_mirror_repair(void);
+extern uint8_t sectors_per_cluster;
+extern uint8_t requested_sectors_per_cluster;
+extern void sdcard_open(void);
+extern void sdcard_writesector(const uint32_t sector_number);
+extern void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector);
+extern uint32_t sdcard_compare_hits;
+extern uint32_t sdcard_compare_misses;
+extern void sdcard_writesectors(const uint32_t first_sector, const uint16_t count, const uint8_t *buffer);
+extern uint32_t sdcard_verify_deferred(void);
+extern uint32_t fat_scan_first_zero(const uint8_t *entries, const uint32_t count);
+extern uint32_t fat_scan_first_nonzero(const uint8_t *entries, const uint32_t count);
+extern uint32_t fat_scan_zero_run(const uint8_t *entries, const uint32_t start, const uint32_t count);
+
+struct test_core_file {
+  const char *name;
+  const char *dos_name;
+  uint32_t length;
+};
+
+// Files embedded in the synthetic core written by write_test_core()
+static const test_core_file test_core_files[] = {
+  { "MEGA65.ROM", "MEGA65  ROM", 131072 + 17 },
+  { "FREEZER.M65", "FREEZER M65", 70000 },
+  { "ETHLOAD.M65", "ETHLOAD M65", 0 },
+  { "C64THUMB.M65", "C64THUMBM65", 1 },
+  { "BIG.D81", "BIG     D81", 819200 },
+};
+#define TEST_CORE_FILE_COUNT (sizeof(test_core_files) / sizeof(test_core_files[0]))
+
+static uint8_t test_core_byte(int file, uint32_t offset)
+{
+  return (offset * 7 + (offset >> 9) + file) & 0xff;
+}
+
+static void put_uint32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get_uint32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Write a minimal core image for slot 0, with the files above embedded
+static void write_test_core(const char *path)
+{
+  std::vector<uint8_t> core(0x1000);
+  uint32_t offset = 0x1000;
+  uint32_t i, j;
+
+  memcpy(&core[0], "MEGA65BITSTREAM0MEGA65", 22);
+  memcpy(&core[48], "TEST CORE", 9);
+  core[0x72] = TEST_CORE_FILE_COUNT;
+  put_uint32(&core[0x73], offset);
+
+  for (i = 0; i < TEST_CORE_FILE_COUNT; i++) {
+    uint32_t next = (offset + 40 + test_core_files[i].length + 3) & ~3;
+    core.resize(next);
+    put_uint32(&core[offset], next);
+    put_uint32(&core[offset + 4], test_core_files[i].length);
+    strcpy((char *)&core[offset + 8], test_core_files[i].name);
+    for (j = 0; j < test_core_files[i].length; j++)
+      core[offset + 40 + j] = test_core_byte(i, j);
+    offset = next;
+  }
+
+  FILE *f = fopen(path, "wb");
+  ASSERT_TRUE(f != NULL);
+  ASSERT_EQ(1, fwrite(&core[0], core.size(), 1, f));
+  fclose(f);
+}
+
+static uint32_t read_fat_entry(uint32_t cluster)
+{
+  sdcard_readsector(fat_partition_start + reserved_sectors + cluster / 128);
+  return get_uint32(&sector_buffer[(cluster & 127) * 4]);
+}
+
+// Find a name in the first sector of a directory, returning its entry offset (sector_buffer holds the sector)
+static int find_dir_entry(uint32_t dir_cluster, const char *dos_name)
+{
+  int e;
+
+  sdcard_readsector(fat_partition_start + rootdir_sector + (dir_cluster - 2) * sectors_per_cluster);
+  for (e = 0; e < 512; e += 32)
+    if (!memcmp(&sector_buffer[e], dos_name, 11))
+      return e;
+  return -1;
+}
+
+static uint32_t dir_entry_cluster(int e)
+{
+  return sector_buffer[e + 0x1a] | (sector_buffer[e + 0x1b] << 8) | (sector_buffer[e + 0x14] << 16)
+         | (sector_buffer[e + 0x15] << 24);
+}
 
 class M65FdiskTestFixture : public ::testing::Test {
   protected:
@@ -16,10 +140,15 @@ class M65FdiskTestFixture : public ::testing::Test {
     ::testing::internal::CaptureStderr();
     ::testing::internal::CaptureStdout();
 
-    // generate empty 4gb sdcard.img file
-    generate_empty_256mb_sdcard_img();
-
-    setenv("SDCARDFILE", "sdcard.img", 1);
+    // work on an empty 1gb card held in memory, rather than an image file
+    setenv("SDCARDBACKEND", "ram", 1);
+    setenv("SDCARDSIZE", "1G", 1);
+    unsetenv("SDCARDDUMP");
+    unsetenv("SDCARDCOMPARE");
+    unsetenv("SDCARDVERIFY");
+    unsetenv("FATCLUSTERSECTORS");
+    unsetenv("FATALIGNSECTORS");
+    requested_sectors_per_cluster = 0;
     setenv("FLASHFILE", "gtest/bin/mega65r3.cor", 1);
   }
 
@@ -28,28 +157,738 @@ class M65FdiskTestFixture : public ::testing::Test {
     testing::internal::GetCapturedStderr();
     testing::internal::GetCapturedStdout();
 
-    // cleanup to remove the dummy .bit and .cor files
-    // remove("sdcard.img");
-  }
-
-  void generate_empty_256mb_sdcard_img(void)
-  {
-    FILE *fl = fopen("sdcard.img", "wb");
-    for (int k = 0; k < 1 * 1024 * 1024 * 1024 / 16; k++) {
-      // fputc(0, fl);
-      fwrite("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16, 1, fl);
-      // fwrite("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",  16, 1, fl);
-      // fwrite("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",  16, 1, fl);
-      // fwrite("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",  16, 1, fl);
-      // fwrite("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",  16, 1, fl);
-    }
-    fclose(fl);
+    // cleanup to remove the dumped card image
+    remove("gtest/bin/sdcard.img");
+    remove("gtest/bin/test.cor");
   }
 };
 
 TEST_F(M65FdiskTestFixture, AssureNoGapsBetweenPrePopulatedFiles)
 {
+  uint32_t i, cluster = 0;
+  int e;
+
+  write_test_core("gtest/bin/test.cor");
+  setenv("FLASHFILE", "gtest/bin/test.cor", 1);
   open_sdcard_and_retrieve_details();
   format_disk();
+
+  // The files must really have been created, or there is nothing to check
+  for (i = 0; i < TEST_CORE_FILE_COUNT; i++) {
+    e = find_dir_entry(2, test_core_files[i].dos_name);
+    ASSERT_GE(e, 0);
+    if (test_core_files[i].length && !cluster)
+      cluster = dir_entry_cluster(e);
+  }
+  ASSERT_LT(2, cluster);
   ASSERT_EQ(0, are_there_gaps_between_files());
+
+  // Freeing the start of the first file leaves a gap before the others
+  sdcard_readsector(fat_partition_start + fat1_sector + cluster / 128);
+  memset(&sector_buffer[(cluster & 127) * 4], 0, 4);
+  sdcard_writesector(fat_partition_start + fat1_sector + cluster / 128);
+  sector_cache_invalidate();
+  ASSERT_EQ(1, are_there_gaps_between_files());
+}
+
+TEST_F(M65FdiskTestFixture, RamDiskIsDumpedToFileOnFlush)
+{
+  uint8_t dumped[512];
+
+  setenv("SDCARDDUMP", "gtest/bin/sdcard.img", 1);
+  open_sdcard_and_retrieve_details();
+  format_disk();
+
+  FILE *f = fopen("gtest/bin/sdcard.img", "rb");
+  ASSERT_TRUE(f != NULL);
+  ASSERT_EQ(0, fseek(f, 0, SEEK_END));
+  ASSERT_EQ(1024L * 1024L * 1024L, ftell(f));
+  ASSERT_EQ(0, fseek(f, 0, SEEK_SET));
+  ASSERT_EQ(1, fread(dumped, 512, 1, f));
+  fclose(f);
+
+  sdcard_readsector(0);
+  ASSERT_EQ(0, memcmp(dumped, sector_buffer, 512));
+  ASSERT_EQ(0x55, dumped[0x1fe]);
+  ASSERT_EQ(0xaa, dumped[0x1ff]);
+}
+
+TEST_F(M65FdiskTestFixture, PrePopulatedFilesMatchTheCore)
+{
+  uint8_t entries[512];
+  uint32_t data_start, i, j, k, found = 0;
+
+  write_test_core("gtest/bin/test.cor");
+  setenv("FLASHFILE", "gtest/bin/test.cor", 1);
+  open_sdcard_and_retrieve_details();
+  format_disk();
+
+  // The root directory is the first cluster of the data area, and the
+  // embedded files fit within its first sector
+  data_start = fat_partition_start + reserved_sectors + 2 * fat_sectors;
+  sdcard_readsector(data_start);
+  memcpy(entries, sector_buffer, 512);
+
+  for (i = 0; i < 512 && entries[i]; i += 32) {
+    if (entries[i + 0x0b] & 0x08)
+      continue; // volume label
+    for (k = 0; k < TEST_CORE_FILE_COUNT; k++)
+      if (!memcmp(&entries[i], test_core_files[k].dos_name, 11))
+        break;
+    ASSERT_LT(k, TEST_CORE_FILE_COUNT);
+    found++;
+
+    uint32_t length = get_uint32(&entries[i + 0x1c]);
+    uint32_t cluster = entries[i + 0x1a] | (entries[i + 0x1b] << 8) | (entries[i + 0x14] << 16) | (entries[i + 0x15] << 24);
+    uint32_t cluster_bytes = 512 * sectors_per_cluster;
+    ASSERT_EQ(test_core_files[k].length, length);
+    if (!length)
+      continue;
+
+    // Chain must be contiguous, and exactly as long as the file
+    for (j = 1; j < (length + cluster_bytes - 1) / cluster_bytes; j++)
+      ASSERT_EQ(cluster + j, read_fat_entry(cluster + j - 1));
+    ASSERT_LE(0x0FFFFFF8, read_fat_entry(cluster + j - 1) & 0x0FFFFFFF);
+
+    for (j = 0; j < length; j++) {
+      if (!(j & 511))
+        sdcard_readsector(data_start + (cluster - 2) * sectors_per_cluster + j / 512);
+      ASSERT_EQ(test_core_byte(k, j), sector_buffer[j & 511]);
+    }
+  }
+  ASSERT_EQ(TEST_CORE_FILE_COUNT, found);
+}
+
+// Create a file straight after formatting, and return its first cluster
+static uint32_t create_test_file(const char *name, long size)
+{
+  long sector = fat32_create_contiguous_file((char *)name, size, fat_partition_start + rootdir_sector);
+  return (sector - fat_partition_start - rootdir_sector) / sectors_per_cluster + 2;
+}
+
+TEST_F(M65FdiskTestFixture, ChainWriterKeepsNeighbouringEntries)
+{
+  const long sizes[3] = { 5000, 70L * 1024 * 1024 + 1, 5000 };
+  uint32_t first[3], cluster_bytes, i, j, n;
+  uint8_t fat1[512];
+
+  open_sdcard_and_retrieve_details();
+  format_disk();
+
+  // A big file whose chain starts and ends part way through FAT sectors
+  // that it shares with the small files either side of it
+  first[0] = create_test_file("SMALL1.PRG", sizes[0]);
+  first[1] = create_test_file("BIG.D81", sizes[1]);
+  first[2] = create_test_file("SMALL2.PRG", sizes[2]);
+  fat32_mirror_finish();
+  sector_cache_flush();
+
+  cluster_bytes = 512 * sectors_per_cluster;
+  for (i = 0; i < 3; i++) {
+    n = (sizes[i] + cluster_bytes - 1) / cluster_bytes;
+    ASSERT_EQ(first[i] + n, i < 2 ? first[i + 1] : first[i] + n);
+    for (j = 1; j < n; j++)
+      ASSERT_EQ(first[i] + j, read_fat_entry(first[i] + j - 1));
+    ASSERT_EQ(0x0FFFFFF8, read_fat_entry(first[i] + n - 1));
+  }
+
+  // Both copies of the FAT agree
+  for (i = first[0] / 128; i <= (first[2] + 1) / 128; i++) {
+    sdcard_readsector(fat_partition_start + fat1_sector + i);
+    memcpy(fat1, sector_buffer, 512);
+    sdcard_readsector(fat_partition_start + fat2_sector + i);
+    ASSERT_EQ(0, memcmp(fat1, sector_buffer, 512));
+  }
+}
+
+TEST_F(M65FdiskTestFixture, InterruptedFatMirrorIsRepaired)
+{
+  uint32_t first, i;
+  uint8_t fat1[512];
+
+  open_sdcard_and_retrieve_details();
+  format_disk();
+
+  // Formatting leaves FAT2 in step, and the FAT marked as cleanly shut down
+  ASSERT_NE(0, read_fat_entry(1) & 0x08000000);
+  ASSERT_EQ(0, fat32_mirror_repair());
+
+  // A finished session, which leaves the next file's chain clear of FAT sector 0
+  create_test_file("EARLY.PRG", 1000000);
+  fat32_mirror_finish();
+  sector_cache_flush();
+  fat32_mirror_begin();
+
+  // Later updates only reach FAT1, which is marked as not clean on the card
+  // straight away, even though nothing has been flushed from the cache
+  first = create_test_file("LATE.PRG", 1000000);
+  ASSERT_LT(0, first / 128);
+  ASSERT_EQ(0, read_fat_entry(1) & 0x08000000);
+  ASSERT_EQ(first + 1, read_fat_entry(first));
+  sdcard_readsector(fat_partition_start + fat2_sector + first / 128);
+  ASSERT_EQ(0, get_uint32(&sector_buffer[(first & 127) * 4]));
+
+  // As if the session had been cut short before FAT2 was brought up to date
+  sector_cache_invalidate();
+  fat32_mirror_begin();
+  ASSERT_EQ(1, fat32_mirror_repair());
+  sector_cache_flush();
+  ASSERT_NE(0, read_fat_entry(1) & 0x08000000);
+  for (i = 0; i < fat_sectors; i++) {
+    sdcard_readsector(fat_partition_start + fat1_sector + i);
+    memcpy(fat1, sector_buffer, 512);
+    sdcard_readsector(fat_partition_start + fat2_sector + i);
+    ASSERT_EQ(0, memcmp(fat1, sector_buffer, 512));
+  }
+}
+
+TEST_F(M65FdiskTestFixture, InterruptedSessionIsOnlyRepairedOnRequest)
+{
+  uint32_t first;
+
+  open_sdcard_and_retrieve_details();
+  format_disk();
+  first = create_test_file("LATE.PRG", 1000000);
+  sector_cache_flush();
+  ASSERT_EQ(0, read_fat_entry(1) & 0x08000000);
+
+  // Not our layout: left alone
+  sectors_per_cluster *= 2;
+  ASSERT_EQ(0, existing_file_system_unclean());
+  repair_existing_file_system();
+  sectors_per_cluster /= 2;
+  ASSERT_EQ(0, read_fat_entry(1) & 0x08000000);
+
+  // Spotting it (as opening the card does) doesn't write anything
+  ASSERT_NE(0, existing_file_system_unclean());
+  ASSERT_EQ(0, read_fat_entry(1) & 0x08000000);
+  sdcard_readsector(fat_partition_start + fat2_sector + first / 128);
+  ASSERT_EQ(0, get_uint32(&sector_buffer[(first & 127) * 4]));
+
+  repair_existing_file_system();
+  ASSERT_EQ(0, existing_file_system_unclean());
+  ASSERT_NE(0, read_fat_entry(1) & 0x08000000);
+  sdcard_readsector(fat_partition_start + fat2_sector + first / 128);
+  ASSERT_EQ(first + 1, get_uint32(&sector_buffer[(first & 127) * 4]));
+}
+
+TEST_F(M65FdiskTestFixture, DuplicateFileNamesAreRejected)
+{
+  char name[16];
+  int i;
+
+  open_sdcard_and_retrieve_details();
+  format_disk();
+
+  // Enough files for the root directory to need more clusters
+  for (i = 0; i < 300; i++) {
+    snprintf(name, sizeof(name), "F%05d.PRG", i);
+    ASSERT_NE(0, fat32_create_contiguous_file(name, 1000, fat_partition_start + rootdir_sector));
+  }
+  for (i = 0; i < 300; i += 7) {
+    snprintf(name, sizeof(name), "F%05d.PRG", i);
+    ASSERT_EQ(0, fat32_create_contiguous_file(name, 1000, fat_partition_start + rootdir_sector));
+  }
+  ASSERT_NE(0, fat32_create_contiguous_file((char *)"F00000.SEQ", 1000, fat_partition_start + rootdir_sector));
+  ASSERT_EQ(0, fat32_create_contiguous_file((char *)"F00000.SEQ", 0, fat_partition_start + rootdir_sector));
+}
+
+TEST_F(M65FdiskTestFixture, BatchCreateSkipsDuplicatesAndChainsEachFile)
+{
+  fat32_file_t files[5] = {
+    { "ONE.PRG", 5000 },
+    { "TWO.PRG", 0 },
+    { "ONE.PRG", 10 },
+    { "THREE.D81", 819200 },
+    { "FOUR.SEQ", 1 },
+  };
+  const char *dos_names[5] = { "ONE     PRG", "TWO     PRG", NULL, "THREE   D81", "FOUR    SEQ" };
+  uint32_t cluster_bytes, data_start, n, i, j, e, found = 0;
+
+  open_sdcard_and_retrieve_details();
+  format_disk();
+
+  ASSERT_EQ(4, fat32_create_contiguous_files(files, 5, fat_partition_start + rootdir_sector));
+  ASSERT_EQ(0, files[2].first_sector);
+  ASSERT_EQ(fat_partition_start + rootdir_sector, files[1].first_sector);
+  sector_cache_flush();
+
+  cluster_bytes = 512 * sectors_per_cluster;
+  for (i = 0; i < 5; i++) {
+    if (!files[i].start_cluster)
+      continue;
+    n = (files[i].size + cluster_bytes - 1) / cluster_bytes;
+    for (j = 1; j < n; j++)
+      ASSERT_EQ(files[i].start_cluster + j, read_fat_entry(files[i].start_cluster + j - 1));
+    ASSERT_EQ(0x0FFFFFF8, read_fat_entry(files[i].start_cluster + n - 1));
+  }
+
+  // Each file has one directory entry, pointing at its clusters
+  data_start = fat_partition_start + rootdir_sector;
+  for (j = 0; j < sectors_per_cluster; j++) {
+    sdcard_readsector(data_start + j);
+    for (e = 0; e < 512; e += 32) {
+      for (i = 0; i < 5; i++)
+        if (dos_names[i] && !memcmp(&sector_buffer[e], dos_names[i], 11))
+          break;
+      if (i == 5)
+        continue;
+      found++;
+      ASSERT_EQ(files[i].size, get_uint32(&sector_buffer[e + 0x1c]));
+      ASSERT_EQ(files[i].start_cluster, sector_buffer[e + 0x1a] | (sector_buffer[e + 0x1b] << 8)
+                                            | (sector_buffer[e + 0x14] << 16) | (sector_buffer[e + 0x15] << 24));
+    }
+  }
+  ASSERT_EQ(4, found);
+}
+
+TEST_F(M65FdiskTestFixture, FilesArePlacedInSubdirectories)
+{
+  fat32_file_t files[4] = {
+    { "GAMES/FOO.D81", 819200 },
+    { "GAMES/RPG/BAR.PRG", 5000 },
+    { "GAMES/FOO.D81", 10 },
+    { "TOP.PRG", 10 },
+  };
+  uint32_t games, rpg;
+  int e;
+
+  open_sdcard_and_retrieve_details();
+  format_disk();
+
+  ASSERT_EQ(3, fat32_create_contiguous_files(files, 4, fat_partition_start + rootdir_sector));
+  ASSERT_EQ(0, files[2].first_sector);
+  // Making a directory that is already there just finds it
+  games = fat32_create_directory((char *)"GAMES", fat_partition_start + rootdir_sector);
+  rpg = fat32_create_directory((char *)"GAMES/RPG", fat_partition_start + rootdir_sector);
+  ASSERT_EQ(0, fat32_create_directory((char *)"TOP.PRG/X", fat_partition_start + rootdir_sector));
+  sector_cache_flush();
+
+  e = find_dir_entry(2, "GAMES      ");
+  ASSERT_GE(e, 0);
+  ASSERT_EQ(0x10, sector_buffer[e + 0x0b]);
+  ASSERT_EQ(games, dir_entry_cluster(e));
+  ASSERT_GE(find_dir_entry(2, "TOP     PRG"), 0);
+  ASSERT_LT(find_dir_entry(2, "FOO     D81"), 0);
+  ASSERT_EQ(0x0FFFFFF8, read_fat_entry(games));
+
+  // "." is the directory itself, and ".." of a directory in the root is cluster 0
+  e = find_dir_entry(games, ".          ");
+  ASSERT_EQ(0, e);
+  ASSERT_EQ(0x10, sector_buffer[0x0b]);
+  ASSERT_EQ(games, dir_entry_cluster(0));
+  ASSERT_EQ(0, memcmp(&sector_buffer[32], "..         ", 11));
+  ASSERT_EQ(0, dir_entry_cluster(32));
+  e = find_dir_entry(games, "FOO     D81");
+  ASSERT_GE(e, 0);
+  ASSERT_EQ(files[0].start_cluster, dir_entry_cluster(e));
+  ASSERT_EQ(819200, get_uint32(&sector_buffer[e + 0x1c]));
+  e = find_dir_entry(games, "RPG        ");
+  ASSERT_GE(e, 0);
+  ASSERT_EQ(rpg, dir_entry_cluster(e));
+
+  find_dir_entry(rpg, "..         ");
+  ASSERT_EQ(games, dir_entry_cluster(32));
+  e = find_dir_entry(rpg, "BAR     PRG");
+  ASSERT_GE(e, 0);
+  ASSERT_EQ(files[1].start_cluster, dir_entry_cluster(e));
+  ASSERT_EQ(files[1].start_cluster + 1, read_fat_entry(files[1].start_cluster));
+  ASSERT_EQ(0x0FFFFFF8, read_fat_entry(files[1].start_cluster + 1));
+}
+
+TEST_F(M65FdiskTestFixture, ClusterSizeFollowsCardSize)
+{
+  ASSERT_EQ(1, choose_sectors_per_cluster(64UL * 2048));
+  ASSERT_EQ(8, choose_sectors_per_cluster(2UL * 1024 * 2048));
+  ASSERT_EQ(16, choose_sectors_per_cluster(14UL * 1024 * 2048));
+  ASSERT_EQ(32, choose_sectors_per_cluster(28UL * 1024 * 2048));
+  ASSERT_EQ(64, choose_sectors_per_cluster(58UL * 1024 * 2048));
+  ASSERT_EQ(128, choose_sectors_per_cluster(0xffffffffUL));
+}
+
+TEST_F(M65FdiskTestFixture, RequestedClusterSizeIsUsedThroughout)
+{
+  uint32_t cluster;
+  long sector;
+
+  setenv("FATCLUSTERSECTORS", "64", 1);
+  open_sdcard_and_retrieve_details();
+  format_disk();
+  ASSERT_EQ(64, sectors_per_cluster);
+  ASSERT_LE((fs_clusters - 2) * 64 + 2 * fat_sectors + reserved_sectors, fat_partition_sectors);
+
+  sdcard_readsector(fat_partition_start);
+  ASSERT_EQ(64, sector_buffer[0x0d]);
+
+  // 100000 bytes is 4 clusters of 32KB, straight after the root directory
+  sector = fat32_create_contiguous_file((char *)"BIG.PRG", 100000, fat_partition_start + rootdir_sector);
+  sector_cache_flush();
+  cluster = (sector - fat_partition_start - rootdir_sector) / 64 + 2;
+  ASSERT_EQ(0, (sector - fat_partition_start - rootdir_sector) % 64);
+  ASSERT_EQ(3, cluster);
+  ASSERT_EQ(4, read_fat_entry(3));
+  ASSERT_EQ(6, read_fat_entry(5));
+  ASSERT_EQ(0x0FFFFFF8, read_fat_entry(6));
+  ASSERT_EQ(0, read_fat_entry(7));
+}
+
+TEST_F(M65FdiskTestFixture, FatsAndDataStartOnAllocationUnits)
+{
+  const char *aligns[2] = { NULL, "2048" };
+  const uint32_t units[2] = { 8192, 2048 };
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (aligns[i])
+      setenv("FATALIGNSECTORS", aligns[i], 1);
+    open_sdcard_and_retrieve_details();
+    format_disk();
+
+    ASSERT_EQ(0, fat_partition_start % units[i]);
+    ASSERT_EQ(0, (fat_partition_start + fat1_sector) % units[i]);
+    ASSERT_EQ(0, (fat_partition_start + rootdir_sector) % units[i]);
+    ASSERT_LE((fs_clusters - 2) * sectors_per_cluster + rootdir_sector, fat_partition_sectors);
+    ASSERT_GE(fat_sectors * 128, fs_clusters);
+
+    sdcard_readsector(fat_partition_start);
+    ASSERT_EQ(reserved_sectors, sector_buffer[0x0e] | (sector_buffer[0x0f] << 8));
+    ASSERT_EQ(fat_sectors, get_uint32(&sector_buffer[0x24]));
+  }
+}
+
+// Check a layout from fdisk_geometry_solve(), returning a description of the first problem found
+static const char *check_geometry(const fdisk_geometry_t *g, unsigned char valid)
+{
+  uint64_t fat_start = g->fat_partition_start + (uint64_t)g->reserved_sectors;
+  uint64_t data_start = fat_start + 2ULL * g->fat_sectors;
+  uint64_t clusters = g->fs_clusters - 2;
+
+  if ((uint64_t)g->fat_partition_start + g->fat_partition_sectors + g->sys_partition_sectors != g->card_sectors)
+    return "partitions don't fill the card";
+  if (g->sys_partition_start != g->fat_partition_start + g->fat_partition_sectors)
+    return "system partition is not after the FAT32 partition";
+  if (g->fat_partition_start % g->align_sectors || fat_start % g->align_sectors || data_start % g->align_sectors)
+    return "not aligned";
+  if (g->reserved_sectors < 32)
+    return "too few reserved sectors";
+  if (data_start + clusters * g->sectors_per_cluster > g->fat_partition_start + (uint64_t)g->fat_partition_sectors)
+    return "clusters go past the end of the partition";
+  if (g->data_sectors != clusters * g->sectors_per_cluster)
+    return "wrong data size";
+  if (g->fat_sectors * 128ULL < g->fs_clusters)
+    return "FAT too small";
+  if (g->fat_sectors != fdisk_geometry_fat_sectors(g->fs_clusters, g->align_sectors))
+    return "FAT bigger than it needs to be";
+  if (clusters > FAT32_MAX_CLUSTERS)
+    return "too many clusters for FAT32";
+  if (valid != (clusters >= FAT32_MIN_CLUSTERS))
+    return "wrong result";
+  if (g->slot_count != fdisk_geometry_slots(g->sys_partition_sectors))
+    return "wrong slot count";
+  // There mustn't be room for another cluster (and the FAT that it needs), or
+  // any room at all once there are as many clusters as FAT32 allows
+  if (clusters == FAT32_MAX_CLUSTERS
+      && g->reserved_sectors + 2ULL * g->fat_sectors + g->data_sectors != g->fat_partition_sectors)
+    return "wasted space at the end of the full partition";
+  if (g->reserved_sectors + 2ULL * fdisk_geometry_fat_sectors(g->fs_clusters + 1, g->align_sectors)
+                 + (clusters + 1) * g->sectors_per_cluster
+             <= g->fat_partition_sectors)
+    return "wasted space at the end of the partition";
+  return NULL;
+}
+
+TEST_F(M65FdiskTestFixture, GeometryIsValidForEveryCardSize)
+{
+  const uint8_t sizes[3] = { 0, 1, 128 };
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  fdisk_geometry_t g;
+  uint64_t card;
+  unsigned char valid;
+  const char *problem;
+  int i;
+
+  // Every MB from 64MB to 2TB (with a few sectors more, so the sizes aren't all round numbers)
+  for (card = 64ULL * 2048; card <= 0xffffffffULL; card += 2048 + (card & 7)) {
+    valid = fdisk_geometry_solve(card, 0, 8192, &g);
+    problem = check_geometry(&g, valid);
+    ASSERT_EQ(NULL, problem) << problem << " for " << card << " sectors";
+    if (card >= 256ULL * 2048)
+      ASSERT_EQ(1, valid) << card;
+  }
+  // The largest card, and a few fixed cluster sizes and allocation units
+  for (i = 0; i < 3; i++) {
+    for (card = 256ULL * 2048; card <= 0xffffffffULL; card = card * 3 + 12345) {
+      valid = fdisk_geometry_solve(card, sizes[i], 16 << i * 4, &g);
+      problem = check_geometry(&g, valid);
+      ASSERT_EQ(NULL, problem) << problem << " for " << card << " sectors";
+    }
+    valid = fdisk_geometry_solve(0xffffffffUL, sizes[i], 8192, &g);
+    ASSERT_EQ(NULL, check_geometry(&g, valid));
+  }
+  ASSERT_EQ(128, g.sectors_per_cluster);
+
+  // Small clusters on the largest card run into the FAT32 limit
+  valid = fdisk_geometry_solve(0xffffffffUL, 8, 8192, &g);
+  ASSERT_EQ(NULL, check_geometry(&g, valid));
+  ASSERT_EQ(FAT32_MAX_CLUSTERS + 2, g.fs_clusters);
+  ASSERT_LT(2UL * 1024 * 2048, g.sys_partition_sectors);
+
+  ASSERT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count(), 1000);
+}
+
+TEST_F(M65FdiskTestFixture, FsInfoTracksPopulatedFiles)
+{
+  uint8_t fsinfo[512];
+  uint32_t cluster, free_count = 0, last_used = 0;
+
+  write_test_core("gtest/bin/test.cor");
+  setenv("FLASHFILE", "gtest/bin/test.cor", 1);
+  open_sdcard_and_retrieve_details();
+  format_disk();
+
+  for (cluster = 2; cluster < fs_clusters; cluster++) {
+    if (read_fat_entry(cluster))
+      last_used = cluster;
+    else
+      free_count++;
+  }
+  sdcard_readsector(fat_partition_start + 1);
+  memcpy(fsinfo, sector_buffer, 512);
+  ASSERT_EQ(free_count, get_uint32(&fsinfo[0x1e8]));
+  ASSERT_EQ(last_used + 1, get_uint32(&fsinfo[0x1ec]));
+
+  // The backup is not wiped by the later erase of the reserved sectors
+  sdcard_readsector(fat_partition_start + 7);
+  ASSERT_EQ(0, memcmp(fsinfo, sector_buffer, 512));
+
+  // New files go after the hint
+  ASSERT_EQ(last_used + 1, create_test_file("NEXT.PRG", 1));
+
+  // ... unless there is no room there
+  fat32_fsinfo_begin(free_count - 1, fs_clusters - 2);
+  ASSERT_EQ(last_used + 2, create_test_file("WRAP.PRG", 10 * 512 * sectors_per_cluster));
+}
+
+TEST_F(M65FdiskTestFixture, EraseAwareCompareSkipsBlankWrites)
+{
+  setenv("SDCARDCOMPARE", "erased", 1);
+  sdcard_open();
+  sdcard_erase(100, 199);
+
+  // Zeroes inside the erased range need neither a read nor a write
+  memset(sector_buffer, 0, 512);
+  sdcard_writesector(150);
+  ASSERT_EQ(1, sdcard_compare_hits);
+  ASSERT_EQ(0, sdcard_compare_misses);
+
+  // Other data is written blind, and the sector is no longer known blank
+  memset(sector_buffer, 0x42, 512);
+  sdcard_writesector(150);
+  ASSERT_EQ(1, sdcard_compare_hits);
+  ASSERT_EQ(0, sdcard_compare_misses);
+
+  memset(sector_buffer, 0, 512);
+  sdcard_writesector(150);
+  ASSERT_EQ(1, sdcard_compare_hits);
+  ASSERT_EQ(1, sdcard_compare_misses);
+  sdcard_readsector(150);
+  ASSERT_EQ(0, sector_buffer[0]);
+
+  // Its neighbours still are
+  sdcard_writesector(149);
+  sdcard_writesector(151);
+  ASSERT_EQ(3, sdcard_compare_hits);
+
+  // Outside the erased range, identical data is caught by comparing
+  sdcard_writesector(150);
+  ASSERT_EQ(4, sdcard_compare_hits);
+  ASSERT_EQ(1, sdcard_compare_misses);
+}
+
+TEST_F(M65FdiskTestFixture, CompareStatsAreReportedOnceAtTheEnd)
+{
+  std::string output;
+  size_t at;
+
+  setenv("SDCARDCOMPARE", "erased", 1);
+  write_test_core("gtest/bin/test.cor");
+  setenv("FLASHFILE", "gtest/bin/test.cor", 1);
+  testing::internal::GetCapturedStderr();
+  testing::internal::CaptureStderr();
+  open_sdcard_and_retrieve_details();
+  format_disk();
+  output = testing::internal::GetCapturedStderr();
+  testing::internal::CaptureStderr();
+
+  // Flushing part way through (e.g., when FAT1 is first marked as not
+  // clean) says nothing
+  at = output.find("Read-before-write:");
+  ASSERT_NE(std::string::npos, at);
+  ASSERT_EQ(std::string::npos, output.find("Read-before-write:", at + 1));
+}
+
+TEST_F(M65FdiskTestFixture, DeferredVerifyCatchesChangedSectors)
+{
+  uint8_t data[4 * 512];
+
+  // Use a real image file, so that it can be changed behind our back
+  FILE *f = fopen("gtest/bin/sdcard.img", "wb");
+  ASSERT_TRUE(f != NULL);
+  ASSERT_EQ(0, ftruncate(fileno(f), 1024 * 1024));
+  fclose(f);
+  setenv("SDCARDBACKEND", "pread", 1);
+  setenv("SDCARDFILE", "gtest/bin/sdcard.img", 1);
+  setenv("SDCARDVERIFY", "deferred", 1);
+  sdcard_open();
+
+  memset(data, 0x5a, sizeof(data));
+  sdcard_writesectors(10, 4, data);
+  memset(sector_buffer, 0xa5, 512);
+  sdcard_writesector(20);
+  // Rewriting a sector must not be mistaken for corruption
+  memset(sector_buffer, 0x33, 512);
+  sdcard_writesector(20);
+  ASSERT_EQ(0, sdcard_verify_deferred());
+
+  sdcard_writesectors(10, 4, data);
+  f = fopen("gtest/bin/sdcard.img", "r+b");
+  ASSERT_TRUE(f != NULL);
+  ASSERT_EQ(0, fseek(f, 12 * 512 + 100, SEEK_SET));
+  fputc(0, f);
+  fclose(f);
+  ASSERT_EQ(1, sdcard_verify_deferred());
+}
+
+// Format and populate a 256MB image file with the given backend
+static void format_image_with_backend(const char *backend, const char *path)
+{
+  FILE *f = fopen(path, "wb");
+  ASSERT_TRUE(f != NULL);
+  fclose(f);
+  ASSERT_EQ(0, truncate(path, 256L * 1024 * 1024));
+  setenv("SDCARDBACKEND", backend, 1);
+  setenv("SDCARDFILE", path, 1);
+  open_sdcard_and_retrieve_details();
+  format_disk();
+  // Let go of the image before it is compared
+  sdcard_open();
+}
+
+TEST_F(M65FdiskTestFixture, EveryBackendWritesTheSameImage)
+{
+  static const char *backends[] = { "mmap", "direct", "uring" };
+  std::vector<uint8_t> expected(1024 * 1024), actual(1024 * 1024);
+  size_t i, got;
+  long chunk;
+
+  write_test_core("gtest/bin/test.cor");
+  setenv("FLASHFILE", "gtest/bin/test.cor", 1);
+  format_image_with_backend("pread", "gtest/bin/pread.img");
+
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    SCOPED_TRACE(backends[i]);
+    format_image_with_backend(backends[i], "gtest/bin/backend.img");
+
+    FILE *e = fopen("gtest/bin/pread.img", "rb");
+    FILE *a = fopen("gtest/bin/backend.img", "rb");
+    ASSERT_TRUE(e != NULL);
+    ASSERT_TRUE(a != NULL);
+    for (chunk = 0;; chunk++) {
+      got = fread(&expected[0], 1, expected.size(), e);
+      ASSERT_EQ(got, fread(&actual[0], 1, actual.size(), a));
+      if (!got)
+        break;
+      // The MAC address in the MEGA65 config sector is random
+      if (!chunk) {
+        memset(&expected[512 + 6], 0, 6);
+        memset(&actual[512 + 6], 0, 6);
+      }
+      ASSERT_EQ(0, memcmp(&expected[0], &actual[0], got)) << "in MB " << chunk;
+    }
+    fclose(e);
+    fclose(a);
+  }
+  remove("gtest/bin/pread.img");
+  remove("gtest/bin/backend.img");
+}
+
+TEST_F(M65FdiskTestFixture, FatScanKernelsMatchSimpleLoop)
+{
+  std::vector<uint8_t> fat(4 * 300 + 1);
+  uint32_t start, count, i, expected_zero, expected_nonzero;
+
+  // Runs of free and used entries, with a used entry that only has its
+  // top byte set thrown in
+  srand(1);
+  for (i = 0; i < 300; i++) {
+    uint32_t v = (rand() % 7 < 3) ? 0 : 1 + rand();
+    if (i == 150)
+      v = 0x0f000000;
+    memcpy(&fat[i * 4 + 1], &v, 4);
+  }
+
+  // Every length from a range of starting points (all of them unaligned,
+  // as the entries start at byte 1)
+  for (start = 0; start < 40; start++) {
+    for (count = 0; start + count <= 300; count++) {
+      const uint8_t *entries = &fat[1 + start * 4];
+      expected_zero = expected_nonzero = count;
+      for (i = 0; i < count; i++) {
+        int is_zero = !(entries[i * 4] | entries[i * 4 + 1] | entries[i * 4 + 2] | entries[i * 4 + 3]);
+        if (is_zero && expected_zero == count)
+          expected_zero = i;
+        if (!is_zero && expected_nonzero == count)
+          expected_nonzero = i;
+      }
+      ASSERT_EQ(expected_zero, fat_scan_first_zero(entries, count));
+      ASSERT_EQ(expected_nonzero, fat_scan_first_nonzero(entries, count));
+    }
+  }
+  ASSERT_EQ(fat_scan_first_nonzero(&fat[1 + 10 * 4], 290), fat_scan_zero_run(&fat[1], 10, 300));
+  ASSERT_EQ(0, fat_scan_first_nonzero(&fat[1 + 150 * 4], 1));
+}
+
+TEST_F(M65FdiskTestFixture, ParallelFatScanMatchesSerialScan)
+{
+  const uint32_t count = 3 * 1024 * 1024 + 77;
+  std::vector<uint8_t> fat(count * 4), serial_bitmap(count / 8 + 1), parallel_bitmap(count / 8 + 1);
+  fat_scan_summary_t serial, parallel, split;
+  uint32_t i = 0, run, v;
+
+  // Long runs of free and used entries, so that runs cross chunk boundaries
+  srand(2);
+  while (i < count) {
+    run = 1 + rand() % (rand() % 8 ? 5000 : 500000);
+    v = rand() % 2 ? 0 : 0x0ffffff8;
+    for (; run && i < count; run--, i++)
+      memcpy(&fat[i * 4], &v, 4);
+  }
+
+  fat_scan_summarise(fat.data(), 2, count, serial_bitmap.data(), &serial);
+  fat_scan_parallel(fat.data(), 2, count, parallel_bitmap.data(), &parallel);
+  ASSERT_EQ(serial.entries, parallel.entries);
+  ASSERT_EQ(serial.free_count, parallel.free_count);
+  ASSERT_EQ(serial.first_free, parallel.first_free);
+  ASSERT_EQ(serial.last_free, parallel.last_free);
+  ASSERT_EQ(serial.last_used, parallel.last_used);
+  ASSERT_EQ(serial.leading_free, parallel.leading_free);
+  ASSERT_EQ(serial.trailing_free, parallel.trailing_free);
+  ASSERT_EQ(serial.longest_free, parallel.longest_free);
+  ASSERT_EQ(serial.longest_start, parallel.longest_start);
+  ASSERT_TRUE(serial_bitmap == parallel_bitmap);
+
+  // The reduction step on its own, splitting in and between runs
+  for (i = 1; i < count; i += 97531) {
+    fat_scan_summarise(fat.data(), 2, i, NULL, &parallel);
+    fat_scan_summarise(&fat[i * 4], 2 + i, count - i, NULL, &split);
+    fat_scan_combine(&parallel, &split);
+    ASSERT_EQ(serial.free_count, parallel.free_count);
+    ASSERT_EQ(serial.first_free, parallel.first_free);
+    ASSERT_EQ(serial.last_free, parallel.last_free);
+    ASSERT_EQ(serial.last_used, parallel.last_used);
+    ASSERT_EQ(serial.leading_free, parallel.leading_free);
+    ASSERT_EQ(serial.trailing_free, parallel.trailing_free);
+    ASSERT_EQ(serial.longest_free, parallel.longest_free);
+    ASSERT_EQ(serial.longest_start, parallel.longest_start);
+  }
 }